@@ -1,305 +1,3109 @@
+#pragma once
+
 #include <atomic>
+#include <cerrno>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <algorithm>
+#include <chrono>
+#include <climits>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-#pragma once
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
 
-namespace PEX {
-namespace BBQ {
-namespace SPSC {
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #define bbq_likely(x)   (__builtin_expect(!!(x),true))
 #define bbq_unlikely(x) (__builtin_expect(!!(x),false))
-#define bbq_load_rlx(x) std::atomic_load_explicit(&x, std::memory_order_relaxed);
-#define bbq_load_acq(x) std::atomic_load_explicit(&x, std::memory_order_acquire);
-#define bbq_store_rlx(x, v) std::atomic_store_explicit(&x, v, std::memory_order_relaxed);
-#define bbq_store_rel(x, v) std::atomic_store_explicit(&x, v, std::memory_order_release);
+#define bbq_load_rlx(x) std::atomic_load_explicit(&x, std::memory_order_relaxed)
+#define bbq_load_acq(x) std::atomic_load_explicit(&x, std::memory_order_acquire)
+#define bbq_store_rlx(x, v) std::atomic_store_explicit(&x, v, std::memory_order_relaxed)
+#define bbq_store_rel(x, v) std::atomic_store_explicit(&x, v, std::memory_order_release)
 
-/* Block based queue with capacity of N and B blocks */
-template<class T, size_t N, size_t B>
-class Queue {
+namespace PEX {
+namespace BBQ {
 
-    /* Each block contains NE entries */
-    static constexpr size_t NE = N / B;
+/* cache line size */
+static constexpr uint64_t CACHELINE_SIZE = 64;
 
-    /* cache line size */
-    static constexpr uint64_t CACHELINE_SIZE = 64;
+/* the number of version bits */
+static constexpr uint64_t VERSION_BITS = 44;
 
-    /* the number of version bits */
-    static constexpr uint64_t VERSION_BITS = 44;
+/* the number of index bits */
+static constexpr uint64_t INDEX_BITS = 20;
 
-    /* the number of index bits */
-    static constexpr uint64_t INDEX_BITS = 20;
+/* 64 bit Field, contains two segments, version and index.
+ * raw() packs it as version << INDEX_BITS | index, so that an integer add
+ * on the raw word bumps the index and an integer max orders by version
+ * first, which is what the FAA and MAX primitives of the paper rely on. */
+struct Field {
+    Field() {}
+    Field(uint64_t vsn, uint64_t idx) : index(idx), version(vsn) {}
+    explicit Field(uint64_t raw)
+        : index(raw & ((1UL << INDEX_BITS) - 1)), version(raw >> INDEX_BITS) {}
+    Field operator+(uint64_t n) const {
+        return Field(version, index + n);
+    }
+    uint64_t raw() const {
+        return ((uint64_t)version << INDEX_BITS) | index;
+    }
+    uint64_t index : INDEX_BITS;
+    uint64_t version : VERSION_BITS;
+};
 
-    /* make sure parameters are valid */
-    static_assert(NE < (1UL << INDEX_BITS), "too many entries in one block");
-    static_assert(N % B == 0, "N % B must be 0");
+/* fetch and add on the index segment, returns the old value */
+inline Field field_faa(std::atomic<uint64_t>& x, uint64_t n,
+                       std::memory_order mo = std::memory_order_acq_rel) {
+    return Field(x.fetch_add(n, mo));
+}
 
-    /* 64 bit Field, contains two segments, version and index */
-    struct Field {
-        Field() {}
-        Field(uint64_t vsn, uint64_t idx) : version(vsn), index(idx) {}
-        Field operator+(uint64_t n) {
-            index += n;
-            return *this;
-        } 
-        struct {
-            uint64_t version : VERSION_BITS;
-            uint64_t index : INDEX_BITS;
-        };
-    };
+/* atomic max on the whole Field, returns the old value */
+inline Field field_max(std::atomic<uint64_t>& x, Field f,
+                       std::memory_order mo = std::memory_order_acq_rel) {
+    uint64_t old = x.load(std::memory_order_relaxed);
+    while (old < f.raw() &&
+           !x.compare_exchange_weak(old, f.raw(), mo, std::memory_order_relaxed));
+    return Field(old);
+}
 
-    /* block, contains NE entries */
-    struct Block {
-        Block(){}
-        void init(uint64_t index) {
-            Field f = Field(0, index);
-            bbq_store_rlx(alloc, f);
-            bbq_store_rlx(comm, f);
-            bbq_store_rlx(resv, f);
-            bbq_store_rlx(cons, f);
-        }
+/* compare and swap on the whole Field, true if x still held expected */
+inline bool field_cas(std::atomic<uint64_t>& x, Field expected, Field desired,
+                      std::memory_order mo = std::memory_order_acq_rel) {
+    uint64_t old = expected.raw();
+    return x.compare_exchange_strong(old, desired.raw(), mo, std::memory_order_relaxed);
+}
 
-        alignas(CACHELINE_SIZE) std::atomic<Field> alloc;
-        alignas(CACHELINE_SIZE) std::atomic<Field> comm;
-        alignas(CACHELINE_SIZE) std::atomic<Field> resv;
-        alignas(CACHELINE_SIZE) std::atomic<Field> cons;
-        alignas(CACHELINE_SIZE) T data[NE];
+/* spin-wait hint to the core */
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
 
-    } __attribute__((aligned(CACHELINE_SIZE)));
+/* timestamp counter of the calling core, steady_clock nanoseconds where
+ * there is none */
+inline uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
 
-    enum RetStatus {NO_ENTRY, NOT_AVAILABLE, SUCCESS, BLOCK_DONE};
+/* futex calls on a 32 bit word, without FUTEX_PRIVATE_FLAG so that queues
+ * in shared memory can sleep across processes too */
+inline bool futex_wait(const void* addr, uint32_t val, const timespec* deadline) {
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline
+    return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET, val, deadline, nullptr,
+                   FUTEX_BITSET_MATCH_ANY) == 0 || errno != ETIMEDOUT;
+}
+inline void futex_wake(const void* addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/* steady_clock is CLOCK_MONOTONIC, as futex_wait expects */
+inline timespec to_timespec(std::chrono::steady_clock::time_point t) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return ts;
+}
 
+/* a suspended operation parked on an EventCount, see EventCount::park */
+struct AsyncWaiter {
+    AsyncWaiter* next = nullptr;
+    /* retries the operation, true once it went through */
+    bool (*attempt)(AsyncWaiter*) = nullptr;
+    /* hands the waiter back to its owner once attempt succeeded */
+    void (*resume)(AsyncWaiter*) = nullptr;
+};
+
+/* Lets one side of a queue sleep until the other side makes progress. The
+ * low half of the word counts waiters, threads sleeping on the futex in
+ * its low 16 bits and parked AsyncWaiters above them, the high half is an
+ * epoch futex. A thread calls prepare_wait(), re-checks its condition and
+ * then wait()s or cancels, notify() only bumps the epoch and issues
+ * FUTEX_WAKE when a thread sleeps and retries the parked waiters when
+ * there are some, so it costs one load when nobody waits. */
+class EventCount {
 public:
-    Queue() {
-        blocks[0].init(0);
-        for (uint64_t i = 1; i < B; i++) {
-            blocks[i].init(NE);
+    EventCount() : val(0) {}
+
+    uint32_t prepare_wait() {
+        return val.fetch_add(WAITER, std::memory_order_seq_cst) >> 32;
+    }
+    void cancel_wait() {
+        val.fetch_sub(WAITER, std::memory_order_seq_cst);
+    }
+
+    /* false if deadline (nullptr for none) passed first */
+    bool wait(uint32_t epoch, const timespec* deadline) {
+        while ((val.load(std::memory_order_acquire) >> 32) == epoch) {
+            if (!futex_wait(epoch_word(), epoch, deadline)) {
+                cancel_wait();
+                return false;
+            }
         }
-        Field f = Field(0, 0);
-        bbq_store_rlx(phead, f);
-        bbq_store_rlx(chead, f);
+        cancel_wait();
+        return true;
     }
-    bool enqueue(T t) {
-        while(true) {
-            // get phead and block
-            Field ph = bbq_load_rlx(phead);
-            Block* b = &blocks[ph.index];
 
-            std::pair<RetStatus, int> retval = allocate_entry(b);
-            if (retval.first == SUCCESS) {
-                commit_entry(b, retval.second, t);
-                return true;
-            } else {
-                RetStatus ret = advance_phead(ph);
-                if (ret == SUCCESS) {
-                    continue;
-                } else {
-                    return false;
-                }
+    /* callers must have published their progress with a seq_cst RMW */
+    void notify() {
+        uint64_t v = val.load(std::memory_order_seq_cst);
+        if (bbq_unlikely(v & WAITER_MASK)) {
+            if (v & SLEEPER_MASK) {
+                val.fetch_add(EPOCH, std::memory_order_seq_cst);
+                futex_wake(epoch_word());
+            }
+            if (v & ASYNC_MASK) {
+                drain(nullptr);
             }
         }
     }
-    bool dequeue(T& t) {
-        while(true) {
-            // get chead and block
-            Field ch = bbq_load_rlx(chead);
-            Block* b = &blocks[ch.index];
 
-            std::pair<RetStatus, Field> retval = reserve_entry(b);
-            // std::cout << "retstatus: " << retval.first << std::endl;
-            if (retval.first == SUCCESS) {
-                t = consume_entry(b, retval.second);
-                return true;
-                // if (t == NULL) {
-                //     continue;
-                // } else {
-                //     return true;
-                // }
-            } else if (retval.first == NO_ENTRY) {
-                return false;
-            } else if (retval.first == NOT_AVAILABLE) {
-                return false;
-            } else {
-                if (advance_chead(ch, retval.second.version)) {
-                    continue;
+    /* Parks w, whose attempt just failed, until a notify() finds that it
+     * goes through, then calls its resume, on the notifying thread. Lock
+     * free: w is pushed on a list and the list is retried once more right
+     * away, in case the notify came in between. True if w went through in
+     * that retry, resume is not called then. Not across processes. */
+    bool park(AsyncWaiter* w) {
+        val.fetch_add(ASYNC, std::memory_order_seq_cst);
+        w->next = bbq_load_rlx(parked);
+        while (!parked.compare_exchange_weak(w->next, w, std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+        }
+        return drain(w);
+    }
+
+    /* spins the waiting side did before sleeping, adapted to how long the
+     * other side usually takes, only touched on the slow path */
+    std::atomic<uint32_t> spin_limit{MIN_SPIN};
+    static constexpr uint32_t MIN_SPIN = 16;
+    static constexpr uint32_t MAX_SPIN = 4096;
+
+private:
+    static constexpr uint64_t WAITER = 1;
+    static constexpr uint64_t SLEEPER_MASK = (1UL << 16) - 1;
+    static constexpr uint64_t ASYNC = 1UL << 16;
+    static constexpr uint64_t ASYNC_MASK = ((1UL << 32) - 1) & ~SLEEPER_MASK;
+    static constexpr uint64_t WAITER_MASK = (1UL << 32) - 1;
+    static constexpr uint64_t EPOCH = 1UL << 32;
+
+    /* retries the parked waiters until no notify() came in during a round,
+     * one thread at a time, the others leave it to that one; true if self
+     * went through */
+    bool drain(AsyncWaiter* self) {
+        bool mine = false;
+        rounds.fetch_add(1, std::memory_order_seq_cst);
+        while (true) {
+            if (draining.exchange(true, std::memory_order_acquire)) {
+                return mine;
+            }
+            uint32_t r;
+            do {
+                r = rounds.load(std::memory_order_seq_cst);
+                mine |= retry(self);
+            } while (rounds.load(std::memory_order_seq_cst) != r);
+            draining.store(false, std::memory_order_release);
+            // a notify() that gave up on draining before the store
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (rounds.load(std::memory_order_seq_cst) == r) {
+                return mine;
+            }
+        }
+    }
+
+    /* one round over the parked waiters, oldest first, the ones that still
+     * fail go back on the list */
+    bool retry(AsyncWaiter* self) {
+        AsyncWaiter* list = parked.exchange(nullptr, std::memory_order_acquire);
+        AsyncWaiter* fifo = nullptr;
+        while (list) {
+            AsyncWaiter* n = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = n;
+        }
+        bool mine = false;
+        AsyncWaiter* kept = nullptr;
+        AsyncWaiter** tail = &kept;
+        while (fifo) {
+            // a resumed waiter may be gone right away
+            AsyncWaiter* n = fifo->next;
+            if (fifo->attempt(fifo)) {
+                val.fetch_sub(ASYNC, std::memory_order_relaxed);
+                if (fifo == self) {
+                    mine = true;
                 } else {
-                    return false;
+                    fifo->resume(fifo);
                 }
+            } else {
+                *tail = fifo;
+                tail = &fifo->next;
+            }
+            fifo = n;
+        }
+        if (kept) {
+            *tail = bbq_load_rlx(parked);
+            while (!parked.compare_exchange_weak(*tail, kept, std::memory_order_release,
+                                                 std::memory_order_relaxed)) {
             }
         }
+        return mine;
     }
 
-    void printData() {
-        for (uint64_t i = 0; i < B; i++) {
-            Field a = bbq_load_rlx(blocks[i].alloc);
-            Field c = bbq_load_rlx(blocks[i].comm);
-            std::cout << "a.index: " << a.index << std::endl;
-            std::cout << "c.index: " << c.index << std::endl;
-            std::cout << "block " << i + 1 << ": ";
-            for (uint64_t j = 0; j < NE; j++) {
-                std::cout << blocks[i].data[j] << " ";
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the epoch is the high half");
+    const void* epoch_word() const {
+        return reinterpret_cast<const uint32_t*>(&val) + 1;
+    }
+
+    std::atomic<uint64_t> val;
+    std::atomic<AsyncWaiter*> parked{nullptr};
+    std::atomic<uint32_t> rounds{0};
+    std::atomic<bool> draining{false};
+};
+
+#if defined(__cpp_impl_coroutine)
+/* the executor of the async_ calls when none is given: the coroutine is
+ * resumed right on the thread that made its operation go through. An
+ * executor is anything with a post(std::coroutine_handle<>) that resumes
+ * the handle later on a thread of its own. */
+struct InlineResume {
+    void post(std::coroutine_handle<> h) { h.resume(); }
+};
+#endif
+
+/* runs op until it succeeds, spinning for ec's spin limit first, calling
+ * relax(i) after the i-th failed try, and then sleeping on ec, false if
+ * deadline (nullptr for none) passes first */
+template<class F, class R>
+bool wait_until(EventCount& ec, F&& op, const timespec* deadline, R&& relax) {
+    uint32_t limit = ec.spin_limit.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < limit; i++) {
+        if (op()) {
+            // spinning paid off, allow a little more of it next time
+            if (limit < EventCount::MAX_SPIN) {
+                ec.spin_limit.store(limit + limit / 8 + 1, std::memory_order_relaxed);
             }
-            std::cout << std::endl;
+            return true;
         }
+        relax(i);
     }
-
-private:
-    std::pair<RetStatus, int> allocate_entry(Block* b) {
-        Field a = bbq_load_rlx(b->alloc)
-        // std::cout << a.index << std::endl;
-        if (a.index >= NE) {
-            return std::make_pair(BLOCK_DONE, -1);
+    if (limit > EventCount::MIN_SPIN) {
+        ec.spin_limit.store(limit / 2, std::memory_order_relaxed);
+    }
+    while (true) {
+        uint32_t epoch = ec.prepare_wait();
+        // pairs with the seq_cst RMW the other side published with
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (op()) {
+            ec.cancel_wait();
+            return true;
         }
-        // should be fetch and add
-        Field old_alloc = bbq_load_acq(b->alloc);
-        int old = old_alloc.index;
-        bbq_store_rel(b->alloc, old_alloc + 1);
-        // faa end
-        if (old >= NE) {
-            return std::make_pair(BLOCK_DONE, -1);
+        if (!ec.wait(epoch, deadline)) {
+            return op();
         }
-        return std::make_pair(SUCCESS, old);
     }
+}
+
+/* uninitialized storage for one T, entries are constructed in place on
+ * commit and moved out and destroyed on consume */
+template<class T>
+struct alignas(T) RawEntry {
+    T* get() { return std::launder(reinterpret_cast<T*>(bytes)); }
+    unsigned char bytes[sizeof(T)];
+};
+
+/* entry type of a queue of T whose entries carry the trace_clock() of
+ * their commit, see ResidenceHistogram */
+template<class T>
+struct Stamped {};
 
-    void commit_entry(Block* b, int index, T t) {
-        b->data[index] = t;
-        // should be atomic add
-        Field c = bbq_load_acq(b->comm);
-        bbq_store_rel(b->comm, c + 1);
-        // add end
+template<class T>
+struct alignas(T) RawEntry<Stamped<T>> {
+    T* get() { return std::launder(reinterpret_cast<T*>(bytes)); }
+    unsigned char bytes[sizeof(T)];
+    uint64_t tsc;
+};
+
+/* what copy_entries streams runs into blocks larger than the last level
+ * cache with: the widest non-temporal stores the cpu supports, found once
+ * at startup; COPY_SCALAR leaves every copy to memcpy. A lower one may be
+ * set before any queue copies, to compare them (see bench/copy.cpp). */
+enum CopyIsa { COPY_SCALAR, COPY_AVX2, COPY_AVX512 };
+
+inline CopyIsa detect_copy_isa() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return COPY_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return COPY_AVX2;
     }
+#endif
+    return COPY_SCALAR;
+}
 
-    RetStatus advance_phead(Field ph) {
-        // std::cout << "enq: entered prod_advance" << std::endl;
-        // std::cout << "phead index: " << ph.index << std::endl;
-        // std::cout << "phead version: " << ph.version << std::endl;
-        Block* nb = &blocks[(ph.index + 1) % B];
-        Field c = bbq_load_rlx(nb->cons);
-        // std::cout << "c.version: " << c.version << std::endl;
-        // std::cout << "c.index: " << c.index << std::endl;
-        // std::cout << "ph.version: " << ph.version << std::endl;
-        // std::cout << "ph.index: " << ph.index << std::endl;
-        if (c.version < ph.version || (c.version == ph.version && c.index != NE)) {
-            Field r = bbq_load_rlx(nb->resv);
-            if (r.index == c.index) {
-                return NO_ENTRY;
-            } else {
-                return NOT_AVAILABLE;
+inline CopyIsa copy_isa = detect_copy_isa();
+
+/* the last level cache size, 0 if unknown */
+inline size_t detect_llc_bytes() {
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc <= 0) {
+        llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+    return llc > 0 ? (size_t)llc : 0;
+}
+
+inline size_t llc_bytes = detect_llc_bytes();
+
+/* Runs of at least this many bytes into blocks larger than the last level
+ * cache are written with non-temporal stores: consumers that trail by a
+ * block or more would find the lines evicted anyway, so they are not read
+ * in for ownership and do not push out what the cache holds. Shorter runs
+ * lose more to the fence and the partly written lines at their ends than
+ * they save (bench/copy --backlog=1). memcpy only streams single copies of
+ * megabytes, never a run of a block. */
+static constexpr size_t STREAM_RUN_BYTES = 16384;
+
+inline bool stream_block(size_t block_bytes) {
+    return llc_bytes != 0 && block_bytes > llc_bytes;
+}
+
+#if defined(__x86_64__)
+/* n >= 256 bytes: one unaligned vector up to dst's next 32 byte boundary,
+ * aligned streams, an overlapping unaligned last vector, then a fence so
+ * the release store that publishes the run orders after the streams */
+__attribute__((target("avx2")))
+inline void stream_avx2(unsigned char* d, const unsigned char* s, size_t n) {
+    using V = __m256i;
+    const unsigned char* last = s + n - 32;
+    unsigned char* dlast = d + n - 32;
+    _mm256_storeu_si256((V*)d, _mm256_loadu_si256((const V*)s));
+    size_t head = 32 - ((uintptr_t)d & 31);
+    d += head, s += head, n -= head;
+    for (; n >= 128; d += 128, s += 128, n -= 128) {
+        V a = _mm256_loadu_si256((const V*)s), b = _mm256_loadu_si256((const V*)(s + 32));
+        V c = _mm256_loadu_si256((const V*)(s + 64)), e = _mm256_loadu_si256((const V*)(s + 96));
+        _mm256_stream_si256((V*)d, a);
+        _mm256_stream_si256((V*)(d + 32), b);
+        _mm256_stream_si256((V*)(d + 64), c);
+        _mm256_stream_si256((V*)(d + 96), e);
+    }
+    for (; n >= 32; d += 32, s += 32, n -= 32) {
+        _mm256_stream_si256((V*)d, _mm256_loadu_si256((const V*)s));
+    }
+    _mm256_storeu_si256((V*)dlast, _mm256_loadu_si256((const V*)last));
+    _mm_sfence();
+}
+
+/* stream_avx2 with 64 byte vectors, a whole line per store, n >= 512 */
+__attribute__((target("avx512f")))
+inline void stream_avx512(unsigned char* d, const unsigned char* s, size_t n) {
+    const unsigned char* last = s + n - 64;
+    unsigned char* dlast = d + n - 64;
+    _mm512_storeu_si512(d, _mm512_loadu_si512(s));
+    size_t head = 64 - ((uintptr_t)d & 63);
+    d += head, s += head, n -= head;
+    for (; n >= 256; d += 256, s += 256, n -= 256) {
+        __m512i a = _mm512_loadu_si512(s), b = _mm512_loadu_si512(s + 64);
+        __m512i c = _mm512_loadu_si512(s + 128), e = _mm512_loadu_si512(s + 192);
+        _mm512_stream_si512((__m512i*)d, a);
+        _mm512_stream_si512((__m512i*)(d + 64), b);
+        _mm512_stream_si512((__m512i*)(d + 128), c);
+        _mm512_stream_si512((__m512i*)(d + 192), e);
+    }
+    for (; n >= 64; d += 64, s += 64, n -= 64) {
+        _mm512_stream_si512((__m512i*)d, _mm512_loadu_si512(s));
+    }
+    _mm512_storeu_si512(dlast, _mm512_loadu_si512(last));
+    _mm_sfence();
+}
+#endif
+
+/* Copies n trivially copyable entries between a block and a caller's
+ * array, which do not overlap. Runs under 32 bytes, a few 8 or 16 byte
+ * entries, are copied entry by entry inline instead of through a memcpy
+ * call. Longer runs go to memcpy, whose own AVX2 / AVX-512 / rep movsb
+ * dispatch measured no slower than vector loops here (bench/copy), unless
+ * stream asks for non-temporal stores and the run is long enough. */
+template<class T>
+inline void copy_entries(T* dst, const T* src, size_t n, bool stream) {
+    static_assert(std::is_trivially_copyable<T>::value, "entries are copied as bytes");
+    size_t bytes = n * sizeof(T);
+    if constexpr (sizeof(T) < 32) {
+        if (bytes < 32) {
+            for (size_t i = 0; i < n; i++) {
+                memcpy(dst + i, src + i, sizeof(T));
             }
+            return;
+        }
+    }
+#if defined(__x86_64__)
+    if (stream && bytes >= STREAM_RUN_BYTES) {
+        unsigned char* d = reinterpret_cast<unsigned char*>(dst);
+        const unsigned char* s = reinterpret_cast<const unsigned char*>(src);
+        if (copy_isa == COPY_AVX512) {
+            stream_avx512(d, s, bytes);
+            return;
         }
-        Field f = Field((ph.version + 1), 0);
-        // should be atomic max
-        Field a = bbq_load_rlx(nb->alloc);
-        if (f.version > a.version) {
-            bbq_store_rlx(nb->alloc, f);
+        if (copy_isa == COPY_AVX2) {
+            stream_avx2(d, s, bytes);
+            return;
         }
-        // atomic max end
+    }
+#endif
+    memcpy(dst, src, bytes);
+}
+
+/* constructs n entries at the uninitialized dst from src */
+template<class T>
+inline void construct_entries(T* dst, const T* src, size_t n, bool stream = false) {
+    if constexpr (std::is_trivially_copyable<T>::value) {
+        copy_entries(dst, src, n, stream);
+    } else {
+        std::uninitialized_copy(src, src + n, dst);
+    }
+}
+
+/* move assigns n entries from src to dst, src is destroyed by the caller */
+template<class T>
+inline void move_entries(T* dst, T* src, size_t n) {
+    if constexpr (std::is_trivially_copyable<T>::value) {
+        copy_entries(dst, src, n, false);
+    } else {
+        std::move(src, src + n, dst);
+    }
+}
+
+/* Queue options are tag types listed after <T, N, B> in any order, each one
+ * derives from its category in namespace option */
+namespace option {
+struct mode {};
+struct allocator {};
+struct stats {};
+struct layout {};
+struct prefetch {};
+struct backoff {};
+struct producers {};
+struct residence {};
+struct watermarks {};
+}
+
+/* the first of Options in category Tag, or Default if there is none */
+template<class Tag, class Default, class... Options>
+struct select_option {
+    using type = Default;
+};
+template<class Tag, class Default, class O, class... Options>
+struct select_option<Tag, Default, O, Options...> {
+    using type = typename std::conditional<std::is_base_of<Tag, O>::value, O,
+        typename select_option<Tag, Default, Options...>::type>::type;
+};
+
+/* retry-new: a full queue rejects new entries until consumers catch up */
+struct RetryNew : option::mode {};
+
+/* drop-old: a full queue overwrites its oldest block, consumers skip what
+ * they lost, for profiling and telemetry where producers must not stall */
+struct DropOld : option::mode {};
+
+/* any number of producer threads, the default */
+struct MultiProducer : option::producers {};
+
+/* only one thread ever enqueues: alloc and comm, which only producers
+ * write, are then updated with a plain store rather than an atomic add */
+struct SingleProducer : option::producers {};
 
-        // should be atomic max
-        Field co = bbq_load_rlx(nb->comm);
-        if (f.version > co.version) {
-            bbq_store_rlx(nb->comm, f);
+/* constructor tag: the queue's memory is known to be all zero bytes, static
+ * storage or a fresh mapping, so construction writes no block counter and
+ * touches no page of the blocks */
+struct Zeroed {};
+inline constexpr Zeroed zeroed{};
+
+/* an allocator with static constexpr bool ZEROED = true hands out memory
+ * that reads as zeros, and a DynamicQueue built on it skips clearing it */
+template<class Alloc, class = void>
+struct zeroed_allocator : std::false_type {};
+template<class Alloc>
+struct zeroed_allocator<Alloc, std::enable_if_t<Alloc::ZEROED>> : std::true_type {};
+
+/* blocks of the default DynamicQueue, from the aligned global operator new */
+struct HeapAllocator : option::allocator {
+    void* allocate(size_t bytes) {
+        return ::operator new(bytes, std::align_val_t(CACHELINE_SIZE));
+    }
+    void deallocate(void* p, size_t) {
+        ::operator delete(p, std::align_val_t(CACHELINE_SIZE));
+    }
+};
+
+/* blocks from a private anonymous mapping: pages are zero and only backed
+ * by memory once the queue first writes to them, so even a queue of many
+ * gigabytes is built in constant time and costs what it has held so far */
+struct MmapAllocator : option::allocator {
+    static constexpr bool ZEROED = true;
+
+    void* allocate(size_t bytes) {
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::bad_alloc();
         }
-        // atomic max end
+        return p;
+    }
+    void deallocate(void* p, size_t bytes) {
+        munmap(p, bytes);
+    }
+};
+
+/* blocks on 2 MB or 1 GB huge pages, falling back to transparent huge pages
+ * when the hugetlb pool has none left, bound to a NUMA node if node >= 0 */
+struct HugePageAllocator : option::allocator {
+    static constexpr bool ZEROED = true;
+    static constexpr size_t PAGE_2MB = 1UL << 21;
+    static constexpr size_t PAGE_1GB = 1UL << 30;
+
+    explicit HugePageAllocator(size_t page_size = PAGE_2MB, int node = -1)
+        : page_size(page_size), node(node) {}
 
-        // should be atomic max
-        ph + 1;
-        if (ph.index >= NE) {
-            ph.index = ph.index % NE;
-            ph.version += 1;
+    void* allocate(size_t bytes) {
+        size_t len = length(bytes);
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                       flags | MAP_HUGETLB | (__builtin_ctzl(page_size) << MAP_HUGE_SHIFT), -1, 0);
+        if (p == MAP_FAILED) {
+            p = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            madvise(p, len, MADV_HUGEPAGE);
+        }
+        // nothing is faulted in yet, so every page lands on node
+        if (node >= 0) {
+            unsigned long mask[16] = {};
+            mask[node / 64] = 1UL << (node % 64);
+            if (syscall(SYS_mbind, p, len, MPOL_BIND, mask, sizeof(mask) * 8 + 1, 0) != 0) {
+                int err = errno;
+                munmap(p, len);
+                throw std::system_error(err, std::generic_category(), "mbind");
+            }
         }
-        bbq_store_rlx(phead, ph);
-        // atomic max end
+        return p;
+    }
+    void deallocate(void* p, size_t bytes) {
+        munmap(p, length(bytes));
+    }
 
-        // std::cout << "exit prod advance" << std::endl;
-        return SUCCESS;
+private:
+    static constexpr int MPOL_BIND = 2;
+
+    size_t length(size_t bytes) const {
+        return (bytes + page_size - 1) / page_size * page_size;
     }
 
-    std::pair<RetStatus, Field> reserve_entry(Block* b) {
-        // std::cout << "reserve entry entered" << std::endl;
-        while (true) {
-            Field r = bbq_load_rlx(b->resv);
-            if (r.index < NE) {
-                Field c = bbq_load_rlx(b->comm);
-                if (r.index == c.index) {
-                    return std::make_pair(NO_ENTRY, r); 
-                }
-                if (c.index != NE) {
-                    Field a = bbq_load_rlx(b->alloc);
-                    if (a.index != c.index) {
-                        return std::make_pair(NOT_AVAILABLE, r);
-                    }
-                }
+    size_t page_size;
+    int node;
+};
 
-                // should be atomic max
-                Field res = bbq_load_rlx(b->resv);
-                int max = std::max((int)res.index, (int)(r.index + 1));
-                Field newresv = Field(r.version, max);
-                Field oldres = bbq_load_rlx(b->resv);
-                bbq_store_rlx(b->resv, newresv);
-                if (oldres.index == r.index) {
-                // atomic max end
-                    return std::make_pair(SUCCESS, r);
-                } else {
-                    std::cout << "IN HERE" << std::endl;
-                    continue;
-                }
+/* what the MPMC queue counts with a stats option, one per outcome of the
+ * allocate / reserve / advance steps plus whole-operation results */
+enum Counter {
+    ALLOC_SUCCESS,          // allocate_entry claimed entries
+    ALLOC_BLOCK_DONE,       // allocate_entry found the phead block full
+    PHEAD_ADVANCE,          // advance_phead opened the next block
+    PHEAD_NO_ENTRY,         // next block not consumed yet, the queue is full
+    PHEAD_NOT_AVAILABLE,    // next block still being consumed or committed
+    RESV_SUCCESS,           // reserve_entry reserved entries
+    RESV_NO_ENTRY,          // nothing committed past resv, empty
+    RESV_NOT_AVAILABLE,     // a producer is still committing into the block
+    RESV_BLOCK_DONE,        // reserve_entry found the chead block consumed
+    RESV_RETRY,             // reserve_entry lost its CAS to another consumer
+    CHEAD_ADVANCE,          // advance_chead moved to the next block
+    CHEAD_FAIL,             // next block not opened by the producers yet
+    QUEUE_FULL,             // an enqueue gave up
+    QUEUE_EMPTY,            // a dequeue gave up
+    ENQUEUED,               // entries enqueued
+    DEQUEUED,               // entries dequeued
+    COUNTERS
+};
+
+/* copy of a queue's counters, taken without stopping it, so the values are
+ * not a consistent cut but every one of them is monotonic */
+struct QueueStats {
+    uint64_t value[COUNTERS] = {};
+
+    uint64_t operator[](Counter c) const { return value[c]; }
+
+    /* snake_case name of c, e.g. for a Prometheus label */
+    static const char* name(Counter c) {
+        static const char* const names[COUNTERS] = {
+            "alloc_success", "alloc_block_done", "phead_advance", "phead_no_entry",
+            "phead_not_available", "resv_success", "resv_no_entry", "resv_not_available",
+            "resv_block_done", "resv_retry", "chead_advance", "chead_fail",
+            "queue_full", "queue_empty", "enqueued", "dequeued",
+        };
+        return names[c];
+    }
+
+    /* calls f(name, value) for every counter */
+    template<class F>
+    void for_each(F&& f) const {
+        for (int c = 0; c < COUNTERS; c++) {
+            f(name(Counter(c)), value[c]);
+        }
+    }
+};
+
+/* no counters, every count() compiles away and the queue gains no bytes */
+struct NoStats : option::stats {
+    void count(Counter, uint64_t = 1) {}
+    QueueStats snapshot() const { return QueueStats(); }
+};
+
+/* relaxed counters spread over SHARDS cache lines, each thread picks one
+ * round-robin on first use, so threads rarely share a line and a snapshot
+ * only has to add up the shards */
+struct CountingStats : option::stats {
+    static constexpr size_t SHARDS = 16;
+
+    void count(Counter c, uint64_t n = 1) {
+        shards[shard()].value[c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    QueueStats snapshot() const {
+        QueueStats s;
+        for (size_t i = 0; i < SHARDS; i++) {
+            for (int c = 0; c < COUNTERS; c++) {
+                s.value[c] += bbq_load_rlx(shards[i].value[c]);
             }
-            // std::cout << "block done" << std::endl;
-            return std::make_pair(BLOCK_DONE, r);
         }
+        return s;
     }
 
-    T consume_entry(Block* b, Field f) {
-        // std::cout << "consume entry entered" << std::endl;
-        T data = b->data[f.index];
-        b->data[f.index] = 0; //FOR TESTING PURPOSES ONLY
-        // should be atomic add
-        Field c = bbq_load_acq(b->cons);
-        bbq_store_rel(b->cons, c + 1);
-        // atomic add end
-        return data;
+private:
+    static size_t shard() {
+        static std::atomic<size_t> next{0};
+        static thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+        return mine;
     }
 
-    bool advance_chead(Field ch, int version) {
-        Block* nb = &blocks[(ch.index + 1) % B];
-        Field c = bbq_load_rlx(nb->comm);
-        if (c.version != ch.version + 1) {
-            return false;
+    struct alignas(CACHELINE_SIZE) Shard {
+        std::atomic<uint64_t> value[COUNTERS] = {};
+    };
+    Shard shards[SHARDS];
+};
+
+/* Backoff policies, called as backoff(attempt) before the attempt-th retry
+ * (from 0) of a contended step: allocate() and reserve() going round again
+ * after a block change, a lost CAS in reserve_entry, and between the spins
+ * of the blocking and timed calls. Any type deriving from option::backoff
+ * with such an operator() will do. */
+
+/* retry at once, the blocking calls still pause between spins, the default */
+struct NoBackoff : option::backoff {
+    void operator()(unsigned) {}
+};
+
+/* one pause per retry */
+struct SpinBackoff : option::backoff {
+    void operator()(unsigned) { cpu_relax(); }
+};
+
+/* gives the cpu away on every retry, for more threads than cpus */
+struct YieldBackoff : option::backoff {
+    void operator()(unsigned) { sched_yield(); }
+};
+
+/* Min << attempt pauses, at most Max */
+template<unsigned Min = 1, unsigned Max = 1024>
+struct ExponentialBackoff : option::backoff {
+    static_assert(Min > 0 && Min <= Max, "need 0 < Min <= Max");
+    void operator()(unsigned attempt) {
+        unsigned n = attempt < 32 && (Max >> attempt) >= Min ? Min << attempt : Max;
+        for (unsigned i = 0; i < n; i++) {
+            cpu_relax();
+        }
+    }
+};
+
+/* Log-linear histogram: values below 8 have a bucket each, above that
+ * every power of two is split into 8 buckets, so a bucket's lower bound
+ * is within 12.5% of every value in it, like an HDR histogram with one
+ * significant decimal digit */
+struct Histogram {
+    static constexpr unsigned SUB_BITS = 3;
+    static constexpr unsigned SUB = 1 << SUB_BITS;
+    static constexpr unsigned BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+    uint64_t count[BUCKETS] = {};
+
+    static unsigned bucket(uint64_t v) {
+        if (v < SUB) {
+            return v;
         }
-        Field f = Field((ch.version + 1), 0);
-        // should be atomic max
-        Field cons = bbq_load_rlx(nb->cons);
-        if (f.version > cons.version) {
-            bbq_store_rlx(nb->cons, f);
+        unsigned e = 63 - __builtin_clzl(v);
+        return (e - SUB_BITS + 1) * SUB + ((v >> (e - SUB_BITS)) & (SUB - 1));
+    }
+
+    /* smallest value that goes into bucket b */
+    static uint64_t lower(unsigned b) {
+        if (b < SUB) {
+            return b;
+        }
+        unsigned e = b / SUB + SUB_BITS - 1;
+        return (uint64_t)(SUB + b % SUB) << (e - SUB_BITS);
+    }
+
+    uint64_t total() const {
+        uint64_t n = 0;
+        for (unsigned b = 0; b < BUCKETS; b++) {
+            n += count[b];
         }
-        // atomic max end
-        // should be atomic max
-        Field resv = bbq_load_rlx(nb->resv);
-        if (f.version > resv.version) {
-            bbq_store_rlx(nb->resv, f);
+        return n;
+    }
+
+    /* lower bound of the bucket holding the q-quantile, 0 <= q <= 1 */
+    uint64_t percentile(double q) const {
+        uint64_t rank = (uint64_t)(q * total());
+        uint64_t seen = 0;
+        for (unsigned b = 0; b < BUCKETS; b++) {
+            seen += count[b];
+            if (seen > rank) {
+                return lower(b);
+            }
         }
-        // atomic max end
-        // should be atomic max
-        ch + 1;
-        if (ch.index >= NE) {
-            ch.index = ch.index % NE;
-            ch.version += 1;
+        return 0;
+    }
+
+    void merge(const Histogram& o) {
+        for (unsigned b = 0; b < BUCKETS; b++) {
+            count[b] += o.count[b];
         }
-        bbq_store_rlx(chead, ch);
-        // atomic max end
+    }
+};
 
-        return true;
+/* no residence times, entries are plain Ts, the default */
+struct NoResidence : option::residence {
+    template<class T>
+    using entry = T;
+    void record(uint64_t) {}
+    Histogram snapshot() const { return Histogram(); }
+};
+
+/* residence times: every entry carries the trace_clock() of its commit
+ * and consumers add now minus that, in trace_clock() ticks, to one of
+ * SHARDS histograms picked per thread, relaxed counters that snapshot()
+ * merges while the queue runs */
+struct ResidenceHistogram : option::residence {
+    static constexpr size_t SHARDS = 8;
+
+    template<class T>
+    using entry = Stamped<T>;
+
+    void record(uint64_t ticks) {
+        shards[shard()].count[Histogram::bucket(ticks)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Histogram snapshot() const {
+        Histogram h;
+        for (size_t i = 0; i < SHARDS; i++) {
+            for (unsigned b = 0; b < Histogram::BUCKETS; b++) {
+                h.count[b] += bbq_load_rlx(shards[i].count[b]);
+            }
+        }
+        return h;
     }
 
 private:
-    alignas(CACHELINE_SIZE) Block blocks[B];
-    alignas(CACHELINE_SIZE) std::atomic<Field> phead;
-    alignas(CACHELINE_SIZE) std::atomic<Field> chead;
+    static size_t shard() {
+        static std::atomic<size_t> next{0};
+        static thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+        return mine;
+    }
+
+    struct alignas(CACHELINE_SIZE) Shard {
+        std::atomic<uint64_t> count[Histogram::BUCKETS] = {};
+    };
+    Shard shards[SHARDS];
+};
+
+/* no occupancy watermarks, the default */
+struct NoWatermarks : option::watermarks {
+    void update(size_t) {}
+};
+
+/* Occupancy watermarks with hysteresis: once the queue holds at least
+ * high entries it is flagged full-ish and f(true, size) is called, once it
+ * drops to low or fewer the flag clears and f(false, size) is called.
+ * The level is looked at when phead or chead moves to another block and
+ * when an enqueue finds the queue full, so once per block of entries on
+ * either side, and the callback runs on that producer or consumer. */
+struct Watermarks : option::watermarks {
+    using Callback = std::function<void(bool high, size_t size)>;
+
+    /* high 0 disables them, the default; f is not synchronized, set it
+     * before the queue is shared */
+    void set(size_t high, size_t low, Callback f = nullptr) {
+        if (high != 0 && low >= high) {
+            throw std::invalid_argument("low watermark must be below the high one");
+        }
+        callback = std::move(f);
+        bbq_store_rlx(lo, low);
+        bbq_store_rlx(hi, high);
+    }
+
+    bool high() const {
+        return bbq_load_rlx(flagged);
+    }
+
+    void update(size_t size) {
+        size_t h = bbq_load_rlx(hi);
+        if (h == 0) {
+            return;
+        }
+        if (!bbq_load_rlx(flagged)) {
+            if (size >= h && !flagged.exchange(true, std::memory_order_relaxed)) {
+                fire(true, size);
+            }
+        } else if (size <= bbq_load_rlx(lo) && flagged.exchange(false, std::memory_order_relaxed)) {
+            fire(false, size);
+        }
+    }
+
+private:
+    void fire(bool high, size_t size) {
+        if (callback) {
+            callback(high, size);
+        }
+    }
+
+    std::atomic<size_t> hi{0};
+    std::atomic<size_t> lo{0};
+    std::atomic<bool> flagged{false};
+    Callback callback;
 };
 
+/* no software prefetch, the default */
+struct NoPrefetch : option::prefetch {};
+
+/* software prefetch at block boundaries: the producer (consumer) whose run
+ * crosses Distance entries before the end of a block pulls the next block's
+ * counters and its first Lines cache lines of entries into its cache, for
+ * writing (reading the entries), so advance_phead (advance_chead) and the
+ * first operations on the next block do not stall on cold lines */
+template<size_t Distance = 8, size_t Lines = 2>
+struct Prefetch : option::prefetch {
+    static constexpr size_t DISTANCE = Distance;
+    static constexpr size_t LINES = Lines;
+};
+
+/* MPMC block header of the Interleaved layout, its NE entries follow it in
+ * memory, counters hold Field::raw() */
+template<class T>
+struct Block {
+    RawEntry<T>* data() {
+        return reinterpret_cast<RawEntry<T>*>(this + 1);
+    }
+
+    /* bytes from one block header to the next for blocks of ne entries */
+    static constexpr size_t stride(size_t ne) {
+        return (sizeof(Block) + ne * sizeof(RawEntry<T>) + CACHELINE_SIZE - 1) /
+               CACHELINE_SIZE * CACHELINE_SIZE;
+    }
+
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> alloc;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> comm;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> resv;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> cons;
+
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+/* Interleaved (default): B Blocks one after the other, each its own four
+ * cache lines of counters followed by its entries */
+struct Interleaved : option::layout {
+    /* what the queue holds on to for one block, a null one marks failure */
+    template<class T>
+    class Ref {
+    public:
+        Ref() : p(nullptr) {}
+        explicit Ref(Block<T>* p) : p(p) {}
+        explicit operator bool() const { return p != nullptr; }
+        std::atomic<uint64_t>& alloc() const { return p->alloc; }
+        std::atomic<uint64_t>& comm() const { return p->comm; }
+        std::atomic<uint64_t>& resv() const { return p->resv; }
+        std::atomic<uint64_t>& cons() const { return p->cons; }
+        RawEntry<T>* data() const { return p->data(); }
+    private:
+        Block<T>* p;
+    };
+
+    template<class T>
+    static constexpr size_t size(size_t ne, size_t b) {
+        return b * Block<T>::stride(ne);
+    }
+
+    template<class T>
+    static void construct(unsigned char* mem, size_t ne, size_t b) {
+        for (uint64_t i = 0; i < b; i++) {
+            new (&mem[i * Block<T>::stride(ne)]) Block<T>();
+        }
+    }
+
+    template<class T>
+    static Ref<T> block(unsigned char* mem, size_t ne, size_t, uint64_t i) {
+        return Ref<T>(reinterpret_cast<Block<T>*>(&mem[i * Block<T>::stride(ne)]));
+    }
+};
+
+/* Separated: the counters of all blocks in four dense arrays, alloc, comm,
+ * resv and cons, then all N entries in one array. The producer-written
+ * arrays (alloc, comm) and the consumer-written ones (resv, cons) each start
+ * on their own pair of cache lines, so the adjacent-line prefetcher does not
+ * pull one side's lines along with the other's. Small blocks no longer cost
+ * four lines of counters each, and consumers stream through the entries of
+ * consecutive blocks linearly. */
+struct Separated : option::layout {
+    template<class T>
+    class Ref {
+    public:
+        Ref() : ctl(nullptr), gap(0), entries(nullptr) {}
+        Ref(std::atomic<uint64_t>* ctl, size_t gap, RawEntry<T>* entries)
+            : ctl(ctl), gap(gap), entries(entries) {}
+        explicit operator bool() const { return ctl != nullptr; }
+        std::atomic<uint64_t>& alloc() const { return ctl[0]; }
+        std::atomic<uint64_t>& comm() const { return ctl[gap]; }
+        std::atomic<uint64_t>& resv() const { return ctl[2 * gap]; }
+        std::atomic<uint64_t>& cons() const { return ctl[3 * gap]; }
+        RawEntry<T>* data() const { return entries; }
+    private:
+        std::atomic<uint64_t>* ctl;     // alloc of this block
+        size_t gap;                     // counters from one array to the next
+        RawEntry<T>* entries;
+    };
+
+    /* counters in one array, rounded up to two cache lines */
+    static constexpr size_t gap(size_t b) {
+        return (b * sizeof(std::atomic<uint64_t>) + 2 * CACHELINE_SIZE - 1) /
+               (2 * CACHELINE_SIZE) * (2 * CACHELINE_SIZE) / sizeof(std::atomic<uint64_t>);
+    }
+
+    template<class T>
+    static constexpr size_t size(size_t ne, size_t b) {
+        return 4 * gap(b) * sizeof(std::atomic<uint64_t>) +
+               (b * ne * sizeof(RawEntry<T>) + CACHELINE_SIZE - 1) / CACHELINE_SIZE * CACHELINE_SIZE;
+    }
+
+    template<class T>
+    static void construct(unsigned char* mem, size_t, size_t b) {
+        std::atomic<uint64_t>* ctl = reinterpret_cast<std::atomic<uint64_t>*>(mem);
+        for (size_t i = 0; i < 4 * gap(b); i++) {
+            new (&ctl[i]) std::atomic<uint64_t>();
+        }
+    }
+
+    template<class T>
+    static Ref<T> block(unsigned char* mem, size_t ne, size_t b, uint64_t i) {
+        size_t g = gap(b);
+        std::atomic<uint64_t>* ctl = reinterpret_cast<std::atomic<uint64_t>*>(mem);
+        RawEntry<T>* entries = reinterpret_cast<RawEntry<T>*>(ctl + 4 * g);
+        return Ref<T>(ctl + i, g, entries + i * ne);
+    }
+};
+
+namespace SPSC {
+
+/* Block based queue with capacity of N and B blocks, for exactly one producer
+ * thread and one consumer thread.
+ *
+ * With a single writer on each side alloc, resv, phead and chead need not be
+ * shared: each side keeps them in its own cache line. The producer publishes
+ * every entry through its block's comm, but only reads the consumer's cons
+ * when it moves to the next block, the consumer only re-reads comm once it
+ * has used up what it saw last time and writes cons once per block. */
+template<class T, size_t N, size_t B>
+class Queue {
+
+    /* Each block contains NE entries */
+    static constexpr size_t NE = N / B;
+
+    /* make sure parameters are valid */
+    static_assert(NE < (1UL << INDEX_BITS), "too many entries in one block");
+    static_assert(N % B == 0, "N % B must be 0");
+
+    /* block, contains NE entries. The k-th time the producer fills a block
+     * is its version k, version 0 means never used, so a block of zero
+     * bytes is a valid unused one */
+    struct Block {
+        Block(){}
+
+        /* written by the producer: version and entries committed so far */
+        alignas(CACHELINE_SIZE) std::atomic<uint64_t> comm;
+        /* written by the consumer: the last version it fully consumed */
+        alignas(CACHELINE_SIZE) std::atomic<uint64_t> cons;
+        alignas(CACHELINE_SIZE) RawEntry<T> data[NE];
+
+    } __attribute__((aligned(CACHELINE_SIZE)));
+
+    /* the private view of one side: block index and version, like phead and
+     * chead, plus the next entry, like alloc and resv */
+    struct Cursor {
+        uint64_t index;
+        uint64_t version;
+        uint64_t entry;
+        /* consumer only: entries of the block known to be committed */
+        uint64_t limit;
+    } __attribute__((aligned(CACHELINE_SIZE)));
+
+public:
+    Queue() {
+        for (uint64_t i = 0; i < B; i++) {
+            bbq_store_rlx(blocks[i].comm, 0);
+            bbq_store_rlx(blocks[i].cons, 0);
+        }
+        prod = Cursor{0, 1, 0, 0};
+        cons = Cursor{0, 1, 0, 0};
+    }
+    /* for memory that is all zero already, the blocks are left untouched
+     * until the producer gets to them */
+    explicit Queue(Zeroed) {
+        prod = Cursor{0, 1, 0, 0};
+        cons = Cursor{0, 1, 0, 0};
+    }
+    ~Queue() {
+        if (!std::is_trivially_destructible<T>::value) {
+            for (uint64_t i = 0; i < B; i++) {
+                std::pair<uint64_t, uint64_t> r = live_range(i);
+                for (uint64_t j = r.first; j < r.second; j++) {
+                    blocks[i].data[j].get()->~T();
+                }
+            }
+        }
+    }
+    bool enqueue(const T& t) {
+        return emplace(t);
+    }
+    bool enqueue(T&& t) {
+        return emplace(std::move(t));
+    }
+    template<class... Args>
+    bool emplace(Args&&... args) {
+        if (bbq_unlikely(prod.entry == NE) && !advance_phead()) {
+            return false;
+        }
+        Block* b = &blocks[prod.index];
+        new (b->data[prod.entry].bytes) T(std::forward<Args>(args)...);
+        prod.entry++;
+        bbq_store_rel(b->comm, Field(prod.version, prod.entry).raw());
+        return true;
+    }
+    bool dequeue(T& t) {
+        if (bbq_unlikely(cons.entry == cons.limit) && !refill()) {
+            return false;
+        }
+        Block* b = &blocks[cons.index];
+        T* e = b->data[cons.entry].get();
+        t = std::move(*e);
+        e->~T();
+        cons.entry++;
+        if (bbq_unlikely(cons.entry == NE)) {
+            // the whole block is consumed, hand it back to the producer
+            bbq_store_rel(b->cons, Field(cons.version, NE).raw());
+        }
+        return true;
+    }
+
+    /* enqueue up to n entries from src, one store to comm per block,
+     * returns the number enqueued, fewer than n once the queue is full */
+    size_t enqueue_bulk(const T* src, size_t n) {
+        size_t done = 0;
+        while (done < n) {
+            if (prod.entry == NE && !advance_phead()) {
+                break;
+            }
+            Block* b = &blocks[prod.index];
+            uint64_t cnt = std::min<uint64_t>(n - done, NE - prod.entry);
+            construct_entries(reinterpret_cast<T*>(b->data[prod.entry].bytes), src + done, cnt,
+                              stream_block(NE * sizeof(T)));
+            prod.entry += cnt;
+            bbq_store_rel(b->comm, Field(prod.version, prod.entry).raw());
+            done += cnt;
+        }
+        return done;
+    }
+
+    /* dequeue up to max entries into dst, returns the number dequeued */
+    size_t dequeue_bulk(T* dst, size_t max) {
+        size_t done = 0;
+        while (done < max) {
+            if (cons.entry == cons.limit && !refill()) {
+                break;
+            }
+            Block* b = &blocks[cons.index];
+            uint64_t cnt = std::min<uint64_t>(max - done, cons.limit - cons.entry);
+            T* first = b->data[cons.entry].get();
+            move_entries(dst + done, first, cnt);
+            std::destroy(first, first + cnt);
+            cons.entry += cnt;
+            if (cons.entry == NE) {
+                bbq_store_rel(b->cons, Field(cons.version, NE).raw());
+            }
+            done += cnt;
+        }
+        return done;
+    }
+
+    /* consumer only: no committed entry left to dequeue */
+    bool empty() {
+        return cons.entry == cons.limit && !refill();
+    }
+
+    /* empties the queue while neither side uses it, in constant time for a
+     * trivially destructible T: both sides start a new version at block 0
+     * and the other blocks count as unused until the producer reaches them */
+    void reset() {
+        if (!std::is_trivially_destructible<T>::value) {
+            for (uint64_t i = 0; i < B; i++) {
+                std::pair<uint64_t, uint64_t> r = live_range(i);
+                for (uint64_t j = r.first; j < r.second; j++) {
+                    blocks[i].data[j].get()->~T();
+                }
+            }
+        }
+        // block 0's cons stays below base, the producer comes back to it
+        // once the consumer finished this round of it
+        base = prod.version + 1;
+        bbq_store_rlx(blocks[0].comm, Field(base, 0).raw());
+        prod = Cursor{0, base, 0, 0};
+        cons = Cursor{0, base, 0, 0};
+    }
+
+    void printData() {
+        for (uint64_t i = 0; i < B; i++) {
+            Field c(bbq_load_rlx(blocks[i].comm));
+            std::cout << "c.version: " << c.version << std::endl;
+            std::cout << "c.index: " << c.index << std::endl;
+            std::cout << "block " << i + 1 << ": ";
+            std::pair<uint64_t, uint64_t> r = live_range(i);
+            for (uint64_t j = r.first; j < r.second; j++) {
+                std::cout << *blocks[i].data[j].get() << " ";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+private:
+    /* version of the block after the one at (index, version) */
+    static uint64_t next_version(uint64_t index, uint64_t version) {
+        return index + 1 == B ? version + 1 : version;
+    }
+
+    /* entries of block i committed but not consumed, for a quiescent queue */
+    std::pair<uint64_t, uint64_t> live_range(uint64_t i) {
+        Field c(bbq_load_rlx(blocks[i].comm));
+        Field done(bbq_load_rlx(blocks[i].cons));
+        // unused, or left over from before reset()
+        if (done.version == c.version || c.version < base) {
+            return std::make_pair(0, 0);
+        }
+        if (i == cons.index && c.version == cons.version) {
+            return std::make_pair(cons.entry, (uint64_t)c.index);
+        }
+        return std::make_pair(0, (uint64_t)c.index);
+    }
+
+    /* the only place the producer reads the consumer's cache lines */
+    bool advance_phead() {
+        uint64_t ni = (prod.index + 1) % B;
+        uint64_t nv = next_version(prod.index, prod.version);
+        Block* nb = &blocks[ni];
+        Field c(bbq_load_acq(nb->cons));
+        // in the first version after a reset() nb holds nothing of interest
+        if (c.version + 1 != nv && !(nv == base && ni != 0)) {
+            // the previous version of nb is still being consumed
+            return false;
+        }
+        bbq_store_rel(nb->comm, Field(nv, 0).raw());
+        prod = Cursor{ni, nv, 0, 0};
+        return true;
+    }
+
+    /* reloads comm once the entries seen last time are used up */
+    bool refill() {
+        if (cons.entry == NE && !advance_chead()) {
+            return false;
+        }
+        Field c(bbq_load_acq(blocks[cons.index].comm));
+        cons.limit = c.index;
+        return cons.entry != cons.limit;
+    }
+
+    bool advance_chead() {
+        uint64_t ni = (cons.index + 1) % B;
+        uint64_t nv = next_version(cons.index, cons.version);
+        Field c(bbq_load_acq(blocks[ni].comm));
+        if (c.version != nv) {
+            // the producer has not reached nb yet
+            return false;
+        }
+        cons = Cursor{ni, nv, 0, 0};
+        return true;
+    }
+
+private:
+    alignas(CACHELINE_SIZE) Block blocks[B];
+    alignas(CACHELINE_SIZE) Cursor prod;
+    /* the version reset() started at, only written while the queue is idle */
+    uint64_t base = 1;
+    alignas(CACHELINE_SIZE) Cursor cons;
+};
+
+}
+
+namespace MPMC {
+
+/* B blocks of N / B entries each, inline in the queue */
+template<class T, size_t Capacity, size_t Blocks, class Layout = Interleaved>
+class StaticBlocks {
+protected:
+    using Block = typename Layout::template Ref<T>;
+
+    /* Each block contains NE entries */
+    static constexpr size_t NE = Capacity / Blocks;
+    static constexpr size_t B = Blocks;
+
+    /* make sure parameters are valid. allocate_entry claims runs with a CAS
+     * that stops at NE, only single entries are added past it, by at most
+     * one per producer thread racing on a full block, so the index bits
+     * overflow only with 2^19 such threads */
+    static_assert(NE < (1UL << (INDEX_BITS - 1)), "too many entries in one block");
+    static_assert(Capacity % Blocks == 0, "N % B must be 0");
+    static_assert(alignof(T) <= CACHELINE_SIZE, "T is over-aligned");
+
+    /* construct value-initializes the counters, every one starts at zero */
+    StaticBlocks() {
+        Layout::template construct<T>(mem, NE, B);
+    }
+    /* in zeroed memory they already are, nothing is written */
+    explicit StaticBlocks(Zeroed) {}
+
+    /* a handle to shared state, const only so approx_size() can look */
+    Block block(uint64_t i) const {
+        return Layout::template block<T>(const_cast<unsigned char*>(mem), NE, B, i);
+    }
+
+private:
+    alignas(CACHELINE_SIZE) unsigned char mem[Layout::template size<T>(NE, B)];
+};
+
+/* blocks sized at run time, taken from an allocator */
+template<class T, class Alloc, class Layout = Interleaved>
+class DynamicBlocks {
+protected:
+    using Block = typename Layout::template Ref<T>;
+
+    DynamicBlocks(size_t capacity, size_t blocks, const Alloc& alloc = Alloc())
+        : NE(check(capacity, blocks)), B(blocks), size(Layout::template size<T>(NE, B)), alloc(alloc) {
+        mem = static_cast<unsigned char*>(this->alloc.allocate(size));
+        if (!zeroed_allocator<Alloc>::value) {
+            Layout::template construct<T>(mem, NE, B);
+        }
+    }
+    ~DynamicBlocks() {
+        alloc.deallocate(mem, size);
+    }
+    DynamicBlocks(const DynamicBlocks&) = delete;
+    DynamicBlocks& operator=(const DynamicBlocks&) = delete;
+
+    /* a handle to shared state, const only so approx_size() can look */
+    Block block(uint64_t i) const {
+        return Layout::template block<T>(const_cast<unsigned char*>(mem), NE, B, i);
+    }
+
+    const size_t NE;
+    const size_t B;
+
+private:
+    /* the run time counterpart of StaticBlocks' static_asserts */
+    static size_t check(size_t capacity, size_t blocks) {
+        static_assert(alignof(T) <= CACHELINE_SIZE, "T is over-aligned");
+        if (blocks == 0 || capacity % blocks != 0) {
+            throw std::invalid_argument("capacity % blocks must be 0");
+        }
+        // the same headroom for single entries added past NE
+        if (capacity / blocks >= (1UL << (INDEX_BITS - 1))) {
+            throw std::invalid_argument("too many entries in one block");
+        }
+        return capacity / blocks;
+    }
+
+    const size_t size;
+    Alloc alloc;
+    unsigned char* mem;
+};
+
+/* Block based queue over the blocks of Storage, safe for any number of
+ * producers and consumers, retry-new by default or drop-old with DropOld,
+ * counting its hot-path outcomes if given CountingStats */
+template<class T, class Storage, class... Options>
+class BasicQueue : private Storage,
+                   private select_option<option::stats, NoStats, Options...>::type,
+                   private select_option<option::backoff, NoBackoff, Options...>::type,
+                   private select_option<option::residence, NoResidence, Options...>::type,
+                   private select_option<option::watermarks, NoWatermarks, Options...>::type {
+
+    using Mode = typename select_option<option::mode, RetryNew, Options...>::type;
+    static constexpr bool DROP_OLD = std::is_same<Mode, DropOld>::value;
+
+    using Stats = typename select_option<option::stats, NoStats, Options...>::type;
+    using Stats::count;
+
+    using Backoff = typename select_option<option::backoff, NoBackoff, Options...>::type;
+
+    using Residence = typename select_option<option::residence, NoResidence, Options...>::type;
+    static constexpr bool RESIDENCE = !std::is_same<Residence, NoResidence>::value;
+
+    using Watermark = typename select_option<option::watermarks, NoWatermarks, Options...>::type;
+    static constexpr bool WATERMARKS = !std::is_same<Watermark, NoWatermarks>::value;
+
+    static constexpr bool SINGLE_PRODUCER = std::is_same<
+        typename select_option<option::producers, MultiProducer, Options...>::type, SingleProducer>::value;
+
+    using Prefetcher = typename select_option<option::prefetch, NoPrefetch, Options...>::type;
+    static constexpr bool PREFETCH = !std::is_same<Prefetcher, NoPrefetch>::value;
+
+    /* consumers read entries a producer may be overwriting and only then
+     * validate them, which is only sound for plain bytes */
+    static_assert(!DROP_OLD || std::is_trivially_copyable<T>::value,
+                  "drop-old mode needs a trivially copyable T");
+
+    using Block = typename Storage::Block;
+    using Storage::NE;
+    using Storage::B;
+    using Storage::block;
+
+    enum RetStatus {NO_ENTRY, NOT_AVAILABLE, SUCCESS, BLOCK_DONE};
+
+public:
+    /* the arguments go to Storage, none or zeroed for a Queue, capacity,
+     * blocks and optionally an allocator for a DynamicQueue. Storage zeroes
+     * the block counters, or finds them zero, and that is all the blocks
+     * need: a block the producers have not reached yet is never looked at
+     * (see fresh()), so construction costs the same for any B. */
+    template<class... Args>
+    explicit BasicQueue(Args&&... args) : Storage(std::forward<Args>(args)...) {
+        uint64_t f = Field(0, 0).raw();
+        bbq_store_rlx(phead, f);
+        bbq_store_rlx(chead, f);
+    }
+
+    /* destroys what is left in the queue, no Slot or View may be alive */
+    ~BasicQueue() {
+        if (!std::is_trivially_destructible<T>::value) {
+            for (uint64_t i = 0; i < B; i++) {
+                std::pair<uint64_t, uint64_t> r = live_range(i);
+                for (uint64_t j = r.first; j < r.second; j++) {
+                    block(i).data()[j].get()->~T();
+                }
+            }
+        }
+    }
+
+    /* a claimed but not yet published entry, construct the T at ptr() and
+     * commit() it. The entry can not be taken back, so a slot abandoned
+     * without commit(), say by an exception between try_reserve() and the
+     * placement new, publishes a value-initialized T in its place for the
+     * block to be retired; T without a default constructor must commit. */
+    class Slot {
+    public:
+        Slot() : q(nullptr), b(), index(0) {}
+        Slot(Slot&& o) : q(o.q), b(o.b), index(o.index) { o.b = Block(); }
+        Slot& operator=(Slot&& o) {
+            if (this != &o) {
+                abandon();
+                q = o.q;
+                b = o.b;
+                index = o.index;
+                o.b = Block();
+            }
+            return *this;
+        }
+        ~Slot() { abandon(); }
+
+        explicit operator bool() const { return bool(b); }
+        /* raw storage, construct the entry with placement new */
+        T* ptr() const { return reinterpret_cast<T*>(b.data()[index].bytes); }
+        /* publishes the T constructed at ptr() */
+        void commit() {
+            if (b) {
+                q->stamp(b, index, 1);
+                q->publish(b, 1);
+                b = Block();
+            }
+        }
+
+    private:
+        void abandon() {
+            if (b) {
+                if constexpr (std::is_default_constructible<T>::value) {
+                    new (ptr()) T();
+                    commit();
+                } else {
+                    // consumers would read and destroy storage that never
+                    // held a T
+                    std::terminate();
+                }
+            }
+        }
+
+        friend class BasicQueue;
+        Slot(BasicQueue* q, Block b, uint64_t index) : q(q), b(b), index(index) {}
+        BasicQueue* q;
+        Block b;
+        uint64_t index;
+    };
+
+    /* a reserved entry read in place, consumed when destroyed or release()d */
+    class View {
+    public:
+        View() : q(nullptr), b(), index(0), entry(nullptr) {}
+        View(View&& o) : q(o.q), b(o.b), index(o.index), entry(o.entry) { o.b = Block(); }
+        View& operator=(View&& o) {
+            if (this != &o) {
+                release();
+                q = o.q;
+                b = o.b;
+                index = o.index;
+                entry = o.entry;
+                o.b = Block();
+            }
+            return *this;
+        }
+        ~View() { release(); }
+
+        explicit operator bool() const { return bool(b); }
+        T* get() const { return entry; }
+        T& operator*() const { return *entry; }
+        T* operator->() const { return entry; }
+        void release() {
+            if (b) {
+                q->observe(b, index, 1);
+                entry->~T();
+                q->retire(b, 1);
+                b = Block();
+            }
+        }
+
+    private:
+        friend class BasicQueue;
+        View(BasicQueue* q, Block b, uint64_t index)
+            : q(q), b(b), index(index), entry(b.data()[index].get()) {}
+        BasicQueue* q;
+        Block b;
+        uint64_t index;
+        T* entry;
+    };
+
+    /* false if the queue is full or the next block is still being consumed */
+    bool enqueue(const T& t) {
+        return emplace(t);
+    }
+    bool enqueue(T&& t) {
+        return emplace(std::move(t));
+    }
+
+    /* constructs the entry in place from args, false as for enqueue */
+    template<class... Args>
+    bool emplace(Args&&... args) {
+        uint64_t n = 1;
+        std::pair<Block, uint64_t> e = allocate(n);
+        if (!e.first) {
+            count(QUEUE_FULL);
+            return false;
+        }
+        commit_entry(e.first, e.second, std::forward<Args>(args)...);
+        count(ENQUEUED);
+        return true;
+    }
+
+    /* false if the queue is empty or the next entry is still being committed */
+    bool dequeue(T& t) {
+        while (true) {
+            uint64_t n = 1;
+            std::pair<Block, Field> e = reserve(n);
+            if (!e.first) {
+                count(QUEUE_EMPTY);
+                return false;
+            }
+            if (consume_entry(e.first, e.second, t)) {
+                count(DEQUEUED);
+                return true;
+            }
+            // drop-old: the entry was overwritten, take the next one
+        }
+    }
+
+    /* enqueue up to n entries from src, claiming each block's share with one
+     * CAS on alloc (retried only when another producer moved it) and
+     * publishing it with one add to comm, returns the
+     * number enqueued, fewer than n once the queue is full */
+    size_t enqueue_bulk(const T* src, size_t n) {
+        size_t done = 0;
+        while (done < n) {
+            uint64_t cnt = n - done;
+            std::pair<Block, uint64_t> e = allocate(cnt);
+            if (!e.first) {
+                count(QUEUE_FULL);
+                break;
+            }
+            commit_entries(e.first, e.second, src + done, cnt);
+            done += cnt;
+        }
+        count(ENQUEUED, done);
+        return done;
+    }
+
+    /* dequeue up to max entries into dst, one add to resv and cons per
+     * block, returns the number dequeued */
+    size_t dequeue_bulk(T* dst, size_t max) {
+        size_t done = 0;
+        while (done < max) {
+            uint64_t cnt = max - done;
+            std::pair<Block, Field> e = reserve(cnt);
+            if (!e.first) {
+                count(QUEUE_EMPTY);
+                break;
+            }
+            if (consume_entries(e.first, e.second, dst + done, cnt)) {
+                done += cnt;
+            }
+        }
+        count(DEQUEUED, done);
+        return done;
+    }
+
+    /* zero-copy batch dequeue of up to max entries: calls f(first, n) on
+     * each run of n committed entries, in place in the block, reserving
+     * and retiring each run with one add, runs of consecutive blocks come
+     * one after the other. The entries are destroyed once f returns, f may
+     * move from them but must not throw. Returns the number drained. */
+    template<class F>
+    size_t drain(F&& f, size_t max) {
+        // a drop-old producer may overwrite the run while f reads it
+        static_assert(!DROP_OLD, "drop-old queues can not be drained in place");
+        // stamped entries are not a plain array of T
+        static_assert(!RESIDENCE, "queues with residence times can not be drained in place");
+        size_t done = 0;
+        while (done < max) {
+            uint64_t cnt = max - done;
+            std::pair<Block, Field> e = reserve(cnt);
+            if (!e.first) {
+                count(QUEUE_EMPTY);
+                break;
+            }
+            T* first = e.first.data()[e.second.index].get();
+            f(first, (size_t)cnt);
+            std::destroy(first, first + cnt);
+            retire(e.first, cnt);
+            done += cnt;
+        }
+        count(DEQUEUED, done);
+        return done;
+    }
+
+    /* drain, but a single run: whatever is committed in the rest of the
+     * block the consumers are in, with one resv CAS and one cons add, for
+     * taking work over a block at a time. Returns the length of the run. */
+    template<class F>
+    size_t drain_block(F&& f) {
+        static_assert(!DROP_OLD, "drop-old queues can not be drained in place");
+        static_assert(!RESIDENCE, "queues with residence times can not be drained in place");
+        uint64_t cnt = NE;
+        std::pair<Block, Field> e = reserve(cnt);
+        if (!e.first) {
+            count(QUEUE_EMPTY);
+            return 0;
+        }
+        T* first = e.first.data()[e.second.index].get();
+        f(first, (size_t)cnt);
+        std::destroy(first, first + cnt);
+        retire(e.first, cnt);
+        count(DEQUEUED, cnt);
+        return cnt;
+    }
+
+    /* Write combining for one producer thread: entries are staged in the
+     * handle and go to the queue through enqueue_bulk, one alloc CAS and
+     * one comm add per block, once batch of them are staged, once the oldest
+     * has waited max_delay (looked at on every enqueue and by poll(), 0
+     * for never) or on flush(). batch and max_delay trade latency for
+     * throughput per handle. The stage is the handle's own, hold one
+     * handle per thread. A handle that goes, or is assigned over, waits
+     * like enqueue_wait until all it staged is in the queue, discard()
+     * first what consumers will not be there for. */
+    class Producer {
+    public:
+        Producer(BasicQueue& q, size_t batch, std::chrono::nanoseconds max_delay)
+            : q(&q), batch(batch ? batch : 1), max_delay(max_delay) {
+            staged.reserve(this->batch);
+        }
+        Producer(Producer&& o)
+            : q(o.q), batch(o.batch), max_delay(o.max_delay), oldest(o.oldest), staged(std::move(o.staged)) {
+            o.q = nullptr;
+        }
+        Producer& operator=(Producer&& o) {
+            if (this != &o) {
+                if (q) {
+                    flush_wait();
+                }
+                q = o.q;
+                batch = o.batch;
+                max_delay = o.max_delay;
+                oldest = o.oldest;
+                staged = std::move(o.staged);
+                o.q = nullptr;
+            }
+            return *this;
+        }
+        ~Producer() {
+            if (q) {
+                flush_wait();
+            }
+        }
+
+        /* false if batch entries are staged already and the queue is too
+         * full to take any of them */
+        bool enqueue(const T& t) {
+            return emplace(t);
+        }
+        bool enqueue(T&& t) {
+            return emplace(std::move(t));
+        }
+        template<class... Args>
+        bool emplace(Args&&... args) {
+            if (staged.size() == batch && !flush() && staged.size() == batch) {
+                return false;
+            }
+            if (staged.empty() && max_delay.count()) {
+                oldest = std::chrono::steady_clock::now();
+            }
+            staged.emplace_back(std::forward<Args>(args)...);
+            if (staged.size() == batch || due()) {
+                flush();
+            }
+            return true;
+        }
+
+        /* hands everything staged to the queue, false if some of it did
+         * not fit and is still staged */
+        bool flush() {
+            if (staged.empty()) {
+                return true;
+            }
+            size_t n = q->enqueue_bulk(staged.data(), staged.size());
+            staged.erase(staged.begin(), staged.begin() + n);
+            return staged.empty();
+        }
+
+        /* flush, sleeping on the queue until all of it went through */
+        void flush_wait() {
+            wait_until(q->not_full, [&] { return flush(); }, nullptr, q->relax());
+        }
+
+        /* drops what is staged, returns the number of entries dropped */
+        size_t discard() {
+            size_t n = staged.size();
+            staged.clear();
+            return n;
+        }
+
+        /* flushes if the oldest staged entry has waited max_delay, for
+         * producers that go quiet */
+        bool poll() {
+            return due() ? flush() : staged.empty();
+        }
+
+        size_t pending() const {
+            return staged.size();
+        }
+
+    private:
+        bool due() const {
+            return max_delay.count() && !staged.empty() &&
+                   std::chrono::steady_clock::now() - oldest >= max_delay;
+        }
+
+        BasicQueue* q;
+        size_t batch;
+        std::chrono::nanoseconds max_delay;
+        std::chrono::steady_clock::time_point oldest;
+        std::vector<T> staged;
+    };
+
+    /* a write combining handle, see Producer */
+    Producer producer(size_t batch = 32,
+                      std::chrono::nanoseconds max_delay = std::chrono::microseconds(50)) {
+        return Producer(*this, batch, max_delay);
+    }
+
+    /* zero-copy enqueue, an empty Slot if enqueue would have failed */
+    Slot try_reserve() {
+        uint64_t n = 1;
+        std::pair<Block, uint64_t> e = allocate(n);
+        if (!e.first) {
+            count(QUEUE_FULL);
+            return Slot();
+        }
+        count(ENQUEUED);
+        return Slot(this, e.first, e.second);
+    }
+
+    /* zero-copy dequeue, an empty View if dequeue would have failed */
+    View try_view() {
+        // a drop-old producer may overwrite the entry while it is viewed
+        static_assert(!DROP_OLD, "drop-old queues can not hand out views");
+        uint64_t n = 1;
+        std::pair<Block, Field> e = reserve(n);
+        if (!e.first) {
+            count(QUEUE_EMPTY);
+            return View();
+        }
+        count(DEQUEUED);
+        return View(this, e.first, e.second.index);
+    }
+
+    /* blocking enqueue, spins for a while and then sleeps on a futex until
+     * consumers free a block */
+    void enqueue_wait(const T& t) {
+        wait_until(not_full, [&] { return emplace(t); }, nullptr, relax());
+    }
+    void enqueue_wait(T&& t) {
+        // emplace only moves from t once it succeeds
+        wait_until(not_full, [&] { return emplace(std::move(t)); }, nullptr, relax());
+    }
+
+    /* blocking dequeue, sleeps until producers commit an entry */
+    void dequeue_wait(T& t) {
+        wait_until(not_empty, [&] { return dequeue(t); }, nullptr, relax());
+    }
+
+    /* enqueue_wait and dequeue_wait giving up after d, false if they did */
+    template<class Rep, class Period>
+    bool try_enqueue_for(const T& t, const std::chrono::duration<Rep, Period>& d) {
+        timespec deadline = to_timespec(std::chrono::steady_clock::now() + d);
+        return wait_until(not_full, [&] { return emplace(t); }, &deadline, relax());
+    }
+    template<class Rep, class Period>
+    bool try_enqueue_for(T&& t, const std::chrono::duration<Rep, Period>& d) {
+        timespec deadline = to_timespec(std::chrono::steady_clock::now() + d);
+        return wait_until(not_full, [&] { return emplace(std::move(t)); }, &deadline, relax());
+    }
+    template<class Rep, class Period>
+    bool try_dequeue_for(T& t, const std::chrono::duration<Rep, Period>& d) {
+        timespec deadline = to_timespec(std::chrono::steady_clock::now() + d);
+        return wait_until(not_empty, [&] { return dequeue(t); }, &deadline, relax());
+    }
+
+#if defined(__cpp_impl_coroutine)
+    /* co_await q.async_dequeue(ex): the next entry, T must be default
+     * constructible. While the queue is empty the coroutine is suspended
+     * and parked on the queue, the producers retry the parked dequeues on
+     * every commit, as many as there are entries, and ex.post() each
+     * coroutine whose dequeue went through. A non-empty queue never
+     * suspends, and nothing changes for the other calls while nobody is
+     * parked. No coroutine may still be parked when the queue goes. */
+    template<class Executor = InlineResume>
+    class DequeueAwaiter : private AsyncWaiter {
+    public:
+        bool await_ready() { return q->dequeue(value); }
+        bool await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            return !q->not_empty.park(this);
+        }
+        T await_resume() { return std::move(value); }
+
+    private:
+        friend class BasicQueue;
+        DequeueAwaiter(BasicQueue* q, Executor* ex) : q(q), ex(ex) {
+            attempt = [](AsyncWaiter* w) {
+                DequeueAwaiter* a = static_cast<DequeueAwaiter*>(w);
+                return a->q->dequeue(a->value);
+            };
+            resume = [](AsyncWaiter* w) {
+                DequeueAwaiter* a = static_cast<DequeueAwaiter*>(w);
+                a->ex->post(a->handle);
+            };
+        }
+        BasicQueue* q;
+        Executor* ex;
+        std::coroutine_handle<> handle;
+        T value;
+    };
+
+    /* co_await q.async_enqueue(t, ex): enqueues t, suspended the same way
+     * while the queue is full, retried by the consumers whenever they free
+     * a block, a drop-old queue never suspends */
+    template<class Executor = InlineResume>
+    class EnqueueAwaiter : private AsyncWaiter {
+    public:
+        bool await_ready() { return q->emplace(std::move(value)); }
+        bool await_suspend(std::coroutine_handle<> h) {
+            handle = h;
+            return !q->not_full.park(this);
+        }
+        void await_resume() {}
+
+    private:
+        friend class BasicQueue;
+        EnqueueAwaiter(BasicQueue* q, T&& t, Executor* ex) : q(q), ex(ex), value(std::move(t)) {
+            attempt = [](AsyncWaiter* w) {
+                EnqueueAwaiter* a = static_cast<EnqueueAwaiter*>(w);
+                // emplace only moves from value once it succeeds
+                return a->q->emplace(std::move(a->value));
+            };
+            resume = [](AsyncWaiter* w) {
+                EnqueueAwaiter* a = static_cast<EnqueueAwaiter*>(w);
+                a->ex->post(a->handle);
+            };
+        }
+        BasicQueue* q;
+        Executor* ex;
+        std::coroutine_handle<> handle;
+        T value;
+    };
+
+    /* ex must outlive the co_await */
+    template<class Executor>
+    DequeueAwaiter<Executor> async_dequeue(Executor& ex) {
+        return DequeueAwaiter<Executor>(this, &ex);
+    }
+    DequeueAwaiter<> async_dequeue() {
+        static InlineResume ex;
+        return DequeueAwaiter<>(this, &ex);
+    }
+    template<class Executor>
+    EnqueueAwaiter<Executor> async_enqueue(T t, Executor& ex) {
+        return EnqueueAwaiter<Executor>(this, std::move(t), &ex);
+    }
+    EnqueueAwaiter<> async_enqueue(T t) {
+        static InlineResume ex;
+        return EnqueueAwaiter<>(this, std::move(t), &ex);
+    }
+#endif
+
+    /* counters of a queue with CountingStats, all zero without, safe to call
+     * while producers and consumers run */
+    QueueStats stats() const {
+        return Stats::snapshot();
+    }
+
+    /* histogram of how long entries waited between commit and consume, in
+     * trace_clock() ticks, with the ResidenceHistogram option */
+    Histogram residence() const {
+        static_assert(RESIDENCE, "residence times need the ResidenceHistogram option");
+        return Residence::snapshot();
+    }
+
+    /* Entries allocated by producers and not yet reserved by consumers,
+     * from phead, chead and the alloc and resv counters of their blocks
+     * with relaxed loads. A snapshot that may be off by the operations in
+     * flight, clamped to [0, capacity()], never blocks or writes. */
+    size_t approx_size() const {
+        // consumers first, so the producer side read later is not behind it
+        Field ch(bbq_load_acq(chead));
+        Field r(bbq_load_rlx(block(ch.index).resv()));
+        Field ph(bbq_load_acq(phead));
+        Field a(bbq_load_rlx(block(ph.index).alloc()));
+        uint64_t consumed = block_seq(ch.index, r.version) * NE + std::min<uint64_t>(r.index, NE);
+        uint64_t produced = block_seq(ph.index, a.version) * NE + std::min<uint64_t>(a.index, NE);
+        if (produced <= consumed) {
+            return 0;
+        }
+        return std::min<uint64_t>(produced - consumed, capacity());
+    }
+
+    /* capacity() - approx_size(); retry-new producers reuse whole blocks
+     * only, so up to a block less may actually fit */
+    size_t approx_free() const {
+        return capacity() - approx_size();
+    }
+
+    size_t capacity() const {
+        return NE * B;
+    }
+
+    /* with the Watermarks option: sets the levels and callback, see there */
+    void set_watermarks(size_t high, size_t low, typename Watermarks::Callback f = nullptr) {
+        static_assert(WATERMARKS, "watermarks need the Watermarks option");
+        Watermark::set(high, low, std::move(f));
+    }
+
+    /* with the Watermarks option: above the high watermark and not yet back
+     * down to the low one */
+    bool above_watermark() const {
+        static_assert(WATERMARKS, "watermarks need the Watermarks option");
+        return Watermark::high();
+    }
+
+    /* drop-old: entries the consumers found overwritten, approximate */
+    uint64_t dropped() const {
+        static_assert(DROP_OLD, "only drop-old queues drop entries");
+        return bbq_load_rlx(lost);
+    }
+
+    /* empties the queue while no other thread uses it, and zeroes
+     * dropped(), in constant time for a trivially destructible T: phead
+     * and chead start a new round at block 0, which is the only block
+     * written, and the others count as fresh until the producers reach
+     * them, whatever their counters still say */
+    void reset() {
+        if (!std::is_trivially_destructible<T>::value) {
+            for (uint64_t i = 0; i < B; i++) {
+                std::pair<uint64_t, uint64_t> r = live_range(i);
+                for (uint64_t j = r.first; j < r.second; j++) {
+                    block(i).data()[j].get()->~T();
+                }
+            }
+        }
+        // no block has a version past phead's + 1
+        base = Field(bbq_load_rlx(phead)).version + 1;
+        init(block(0), Field(base, 0));
+        bbq_store_rlx(phead, Field(base, 0).raw());
+        bbq_store_rlx(chead, Field(base, 0).raw());
+        bbq_store_rlx(lost, 0);
+        watermark();
+    }
+
+    void printData() {
+        for (uint64_t i = 0; i < B; i++) {
+            Field a(bbq_load_rlx(block(i).alloc()));
+            Field c(bbq_load_rlx(block(i).comm()));
+            std::cout << "a.index: " << a.index << std::endl;
+            std::cout << "c.index: " << c.index << std::endl;
+            std::cout << "block " << i + 1 << ": ";
+            std::pair<uint64_t, uint64_t> r = live_range(i);
+            for (uint64_t j = r.first; j < r.second; j++) {
+                std::cout << *block(i).data()[j].get() << " ";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+private:
+    /* claims a run of at most n entries in the phead block, advancing phead
+     * as needed, n is set to the run length, a null Block if the queue is full */
+    std::pair<Block, uint64_t> allocate(uint64_t& n) {
+        for (unsigned attempt = 0; ; attempt++) {
+            if (attempt) {
+                backoff(attempt - 1);
+            }
+            Field ph(bbq_load_acq(phead));
+            Block b = block(ph.index);
+
+            std::pair<RetStatus, uint64_t> retval = allocate_entry(b, n);
+            if (retval.first == SUCCESS) {
+                if constexpr (PREFETCH) {
+                    if (near_end(retval.second, n)) {
+                        prefetch_next(ph.index, true);
+                    }
+                }
+                return std::make_pair(b, retval.second);
+            }
+            if (advance_phead(ph) != SUCCESS) {
+                watermark();
+                return std::make_pair(Block(), 0);
+            }
+            watermark();
+        }
+    }
+
+    /* reserves a run of at most n entries in the chead block, advancing
+     * chead as needed, n is set to the run length, a null Block if empty */
+    std::pair<Block, Field> reserve(uint64_t& n) {
+        for (unsigned attempt = 0; ; attempt++) {
+            if (attempt) {
+                backoff(attempt - 1);
+            }
+            Field ch(bbq_load_acq(chead));
+            Block b = block(ch.index);
+
+            std::pair<RetStatus, Field> retval = reserve_entry(b, n);
+            if (retval.first == SUCCESS) {
+                if constexpr (PREFETCH) {
+                    if (near_end(retval.second.index, n)) {
+                        prefetch_next(ch.index, false);
+                    }
+                }
+                return std::make_pair(b, retval.second);
+            } else if (retval.first != BLOCK_DONE) {
+                return std::make_pair(Block(), retval.second);
+            }
+            if (!advance_chead(ch, retval.second.version)) {
+                return std::make_pair(Block(), retval.second);
+            }
+        }
+    }
+
+    /* the block level occupancy check of the Watermarks option */
+    void watermark() {
+        if constexpr (WATERMARKS) {
+            Watermark::update(approx_size());
+        }
+    }
+
+    void backoff(unsigned attempt) {
+        static_cast<Backoff&>(*this)(attempt);
+    }
+
+    /* what the blocking calls do between spins, a pause unless a backoff
+     * policy says otherwise */
+    auto relax() {
+        return [this](unsigned i) {
+            if constexpr (std::is_same<Backoff, NoBackoff>::value) {
+                cpu_relax();
+            } else {
+                backoff(i);
+            }
+        };
+    }
+
+    /* whether the run [index, index + n) holds the prefetch point of its
+     * block, exactly one run per block and round does */
+    bool near_end(uint64_t index, uint64_t n) const {
+        uint64_t at = NE > Prefetcher::DISTANCE ? NE - Prefetcher::DISTANCE : 0;
+        return index <= at && at < index + n;
+    }
+
+    /* producers are about to write the next block's alloc, comm and entries
+     * and read its cons and resv, consumers the other way round */
+    void prefetch_next(uint64_t index, bool producer) {
+        Block nb = block((index + 1) % B);
+        if (producer) {
+            __builtin_prefetch(&nb.alloc(), 1, 3);
+            __builtin_prefetch(&nb.comm(), 1, 3);
+            __builtin_prefetch(&nb.cons(), 0, 3);
+            __builtin_prefetch(&nb.resv(), 0, 3);
+        } else {
+            __builtin_prefetch(&nb.resv(), 1, 3);
+            __builtin_prefetch(&nb.cons(), 1, 3);
+            __builtin_prefetch(&nb.comm(), 0, 3);
+            __builtin_prefetch(&nb.alloc(), 0, 3);
+        }
+        const char* data = reinterpret_cast<const char*>(nb.data());
+        size_t bytes = std::min<size_t>(Prefetcher::LINES * CACHELINE_SIZE, NE * sizeof(T));
+        for (size_t off = 0; off < bytes; off += CACHELINE_SIZE) {
+            if (producer) {
+                __builtin_prefetch(data + off, 1, 3);
+            } else {
+                __builtin_prefetch(data + off, 0, 3);
+            }
+        }
+    }
+
+    static void init(Block b, Field f) {
+        bbq_store_rlx(b.alloc(), f.raw());
+        bbq_store_rlx(b.comm(), f.raw());
+        bbq_store_rlx(b.resv(), f.raw());
+        bbq_store_rlx(b.cons(), f.raw());
+    }
+
+    /* the block after ph has not been used since construction or reset():
+     * its counters are zero or stale and it is free to take */
+    bool fresh(Field ph) const {
+        return ph.version == base && (uint64_t)ph.index + 1 < B;
+    }
+
+    /* entries of block i committed but not consumed, for a quiescent
+     * queue, where resv has caught up with cons */
+    std::pair<uint64_t, uint64_t> live_range(uint64_t i) {
+        Field c(bbq_load_rlx(block(i).comm()));
+        Field r(bbq_load_rlx(block(i).resv()));
+        // not used in this round of the blocks since reset() started it
+        if (c.version < (i == 0 ? base : base + 1)) {
+            return std::make_pair(0, 0);
+        }
+        if (c.version != r.version) {
+            return std::make_pair(0, (uint64_t)c.index);
+        }
+        return std::make_pair((uint64_t)r.index, (uint64_t)c.index);
+    }
+
+    /* cursor of the block after f, wraps into the next version */
+    Field next(Field f) const {
+        if ((uint64_t)f.index + 1 == B) {
+            return Field(f.version + 1, 0);
+        }
+        return Field(f.version, f.index + 1);
+    }
+
+    /* claims a run of at most n entries, n is set to what was granted */
+    std::pair<RetStatus, uint64_t> allocate_entry(Block b, uint64_t& n) {
+        // cheap check first, so a done block is not pushed further past NE,
+        // and never ask for more than the block had left at that point
+        Field a(bbq_load_rlx(b.alloc()));
+        if (a.index >= NE) {
+            count(ALLOC_BLOCK_DONE);
+            return std::make_pair(BLOCK_DONE, 0);
+        }
+        n = std::min<uint64_t>(n, NE - a.index);
+        Field old = a;
+        if constexpr (SINGLE_PRODUCER) {
+            bbq_store_rel(b.alloc(), (a + n).raw());
+        } else if (n == 1) {
+            old = field_faa(b.alloc(), 1);
+        } else {
+            // a run is claimed with a CAS, never past NE: concurrent adds of
+            // up to NE each could carry alloc's index into its version bits
+            while (!field_cas(b.alloc(), old, old + n)) {
+                old = Field(bbq_load_rlx(b.alloc()));
+                if (old.index >= NE) {
+                    break;
+                }
+                n = std::min<uint64_t>(n, NE - old.index);
+            }
+        }
+        if (old.index >= NE) {
+            count(ALLOC_BLOCK_DONE);
+            return std::make_pair(BLOCK_DONE, 0);
+        }
+        n = std::min<uint64_t>(n, NE - old.index);
+        count(ALLOC_SUCCESS);
+        return std::make_pair(SUCCESS, (uint64_t)old.index);
+    }
+
+    template<class... Args>
+    void commit_entry(Block b, uint64_t index, Args&&... args) {
+        new (b.data()[index].bytes) T(std::forward<Args>(args)...);
+        stamp(b, index, 1);
+        publish(b, 1);
+    }
+
+    void commit_entries(Block b, uint64_t index, const T* src, uint64_t n) {
+        if constexpr (RESIDENCE) {
+            for (uint64_t i = 0; i < n; i++) {
+                new (b.data()[index + i].bytes) T(src[i]);
+            }
+        } else {
+            construct_entries(reinterpret_cast<T*>(b.data()[index].bytes), src, n,
+                              stream_block(NE * sizeof(T)));
+        }
+        stamp(b, index, n);
+        publish(b, n);
+    }
+
+    /* residence times: entries [index, index + n) are committed now */
+    void stamp(Block b, uint64_t index, uint64_t n) {
+        if constexpr (RESIDENCE) {
+            uint64_t now = trace_clock();
+            for (uint64_t i = 0; i < n; i++) {
+                b.data()[index + i].tsc = now;
+            }
+        }
+    }
+
+    /* residence times: entries [index, index + n) are consumed now, a
+     * stamp taken on another core may be a little ahead of ours */
+    void observe(Block b, uint64_t index, uint64_t n) {
+        if constexpr (RESIDENCE) {
+            uint64_t now = trace_clock();
+            for (uint64_t i = 0; i < n; i++) {
+                uint64_t tsc = b.data()[index + i].tsc;
+                Residence::record(now > tsc ? now - tsc : 0);
+            }
+        }
+    }
+
+    /* makes n written entries visible and wakes sleeping consumers, seq_cst
+     * (a plain lock xadd on x86) so that a consumer going to sleep either
+     * sees the entries or is seen by notify() */
+    void publish(Block b, uint64_t n) {
+        Field old;
+        if constexpr (SINGLE_PRODUCER) {
+            // still seq_cst, an xchg, for the handshake with sleepers
+            old = Field(bbq_load_rlx(b.comm()));
+            b.comm().store((old + n).raw(), std::memory_order_seq_cst);
+        } else {
+            old = field_faa(b.comm(), n, std::memory_order_seq_cst);
+        }
+        not_empty.notify();
+        // drop-old producers wait for the previous round of a block to be
+        // fully committed rather than consumed
+        if (DROP_OLD && old.index + n == NE) {
+            not_full.notify();
+        }
+    }
+
+    /* hands n consumed entries back, producers can only reuse whole blocks,
+     * so they are woken when the last entry of one is consumed */
+    void retire(Block b, uint64_t n) {
+        Field old = field_faa(b.cons(), n, std::memory_order_seq_cst);
+        if (old.index + n == NE) {
+            not_full.notify();
+        }
+    }
+
+    /* position of block idx at version vsn in the order producers fill them */
+    uint64_t block_seq(uint64_t idx, uint64_t vsn) const {
+        return (idx == 0 ? vsn : vsn - 1) * B + idx;
+    }
+
+    RetStatus advance_phead(Field ph) {
+        Block nb = block((ph.index + 1) % B);
+        if (fresh(ph)) {
+            // nothing to wait for
+        } else if constexpr (DROP_OLD) {
+            // take over nb whatever the consumers did, unless a producer of
+            // its previous round is still committing into it
+            Field c(bbq_load_acq(nb.comm()));
+            if (c.version == ph.version && c.index != NE) {
+                count(PHEAD_NOT_AVAILABLE);
+                return NOT_AVAILABLE;
+            }
+        } else {
+            // the previous round of nb must be fully consumed before reuse
+            Field c(bbq_load_acq(nb.cons()));
+            if (c.version < ph.version || (c.version == ph.version && c.index != NE)) {
+                Field r(bbq_load_acq(nb.resv()));
+                if (r.index == c.index) {
+                    count(PHEAD_NO_ENTRY);
+                    return NO_ENTRY;
+                } else {
+                    count(PHEAD_NOT_AVAILABLE);
+                    return NOT_AVAILABLE;
+                }
+            }
+        }
+        // comm before alloc, so nobody commits into the old round's counter
+        Field f = Field(ph.version + 1, 0);
+        field_max(nb.comm(), f);
+        field_max(nb.alloc(), f);
+        field_max(phead, next(ph));
+        count(PHEAD_ADVANCE);
+        return SUCCESS;
+    }
+
+    /* reserves a run of at most n entries, n is set to what was granted */
+    std::pair<RetStatus, Field> reserve_entry(Block b, uint64_t& n) {
+        for (unsigned attempt = 0; ; attempt++) {
+            Field r(bbq_load_acq(b.resv()));
+            if (r.index >= NE) {
+                count(RESV_BLOCK_DONE);
+                return std::make_pair(BLOCK_DONE, r);
+            }
+            Field c(bbq_load_acq(b.comm()));
+            if constexpr (DROP_OLD) {
+                // producers lapped us into a new round of this block, so the
+                // rest of r's round is overwritten: close it, counting what
+                // was never reserved once, and let advance_chead follow them
+                if (c.version != r.version) {
+                    if (!field_cas(b.resv(), r, Field(r.version, NE))) {
+                        count(RESV_RETRY);
+                        continue;
+                    }
+                    lost.fetch_add(NE - r.index, std::memory_order_relaxed);
+                    count(RESV_BLOCK_DONE);
+                    return std::make_pair(BLOCK_DONE, r);
+                }
+            }
+            if (r.index == c.index) {
+                count(RESV_NO_ENTRY);
+                return std::make_pair(NO_ENTRY, r);
+            }
+            // a partially committed block is only readable once every
+            // allocated entry is committed, otherwise FIFO order breaks
+            if (c.index != NE) {
+                Field a(bbq_load_acq(b.alloc()));
+                if (a.index != c.index) {
+                    count(RESV_NOT_AVAILABLE);
+                    return std::make_pair(NOT_AVAILABLE, r);
+                }
+            }
+            // c and r are in one round here, and resv never passes comm
+            uint64_t cnt = std::min<uint64_t>(n, (uint64_t)c.index - r.index);
+            // a plain max could skip entries when runs of several sizes race
+            if (field_cas(b.resv(), r, r + cnt)) {
+                n = cnt;
+                count(RESV_SUCCESS);
+                return std::make_pair(SUCCESS, r);
+            }
+            // another consumer took r, retry with the new resv
+            count(RESV_RETRY);
+            backoff(attempt);
+        }
+    }
+
+    bool consume_entry(Block b, Field f, T& t) {
+        if constexpr (DROP_OLD) {
+            // copy first, then check a producer did not take the block over
+            // meanwhile, the same way a seqlock reader validates
+            T data = *b.data()[f.index].get();
+            uint64_t tsc = 0;
+            if constexpr (RESIDENCE) {
+                tsc = b.data()[f.index].tsc;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            Field a(bbq_load_rlx(b.alloc()));
+            if (a.version != f.version) {
+                lost.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if constexpr (RESIDENCE) {
+                uint64_t now = trace_clock();
+                Residence::record(now > tsc ? now - tsc : 0);
+            }
+            t = data;
+            return true;
+        }
+        observe(b, f.index, 1);
+        T* e = b.data()[f.index].get();
+        t = std::move(*e);
+        e->~T();
+        retire(b, 1);
+        return true;
+    }
+
+    bool consume_entries(Block b, Field f, T* dst, uint64_t n) {
+        if constexpr (RESIDENCE) {
+            for (uint64_t i = 0; i < n; i++) {
+                dst[i] = std::move(*b.data()[f.index + i].get());
+            }
+        } else {
+            move_entries(dst, b.data()[f.index].get(), n);
+        }
+        if constexpr (DROP_OLD) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            Field a(bbq_load_rlx(b.alloc()));
+            if (a.version != f.version) {
+                lost.fetch_add(n, std::memory_order_relaxed);
+                return false;
+            }
+            if constexpr (RESIDENCE) {
+                // the stamps are read after the entries, keep them only if
+                // the block was still not taken over once they were read
+                uint64_t now = trace_clock();
+                uint64_t tsc[64];
+                for (uint64_t i = 0; i < n; i += 64) {
+                    uint64_t m = std::min<uint64_t>(64, n - i);
+                    for (uint64_t j = 0; j < m; j++) {
+                        tsc[j] = b.data()[f.index + i + j].tsc;
+                    }
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (Field(bbq_load_rlx(b.alloc())).version != f.version) {
+                        break;
+                    }
+                    for (uint64_t j = 0; j < m; j++) {
+                        Residence::record(now > tsc[j] ? now - tsc[j] : 0);
+                    }
+                }
+            }
+            return true;
+        }
+        observe(b, f.index, n);
+        for (uint64_t i = 0; i < n; i++) {
+            b.data()[f.index + i].get()->~T();
+        }
+        retire(b, n);
+        return true;
+    }
+
+    /* version is the resv version the consumers finished the current block at */
+    bool advance_chead(Field ch, uint64_t version) {
+        Block nb = block((ch.index + 1) % B);
+        Field c(bbq_load_acq(nb.comm()));
+        if constexpr (DROP_OLD) {
+            // nb may have been taken over several rounds ahead, follow the
+            // producers to the round it holds now
+            uint64_t expected = version + (ch.index == 0);
+            if (c.version < expected) {
+                count(CHEAD_FAIL);
+                return false;
+            }
+            Field f = Field(c.version, 0);
+            Field old = field_max(nb.resv(), f);
+            if (old.raw() < f.raw() && c.version > expected) {
+                // the blocks fully overwritten between the two rounds
+                uint64_t skipped = block_seq((ch.index + 1) % B, c.version) -
+                                   block_seq(ch.index, version) - 1;
+                lost.fetch_add(skipped * NE, std::memory_order_relaxed);
+            }
+        } else {
+            // nb must already be opened by the producers for this round
+            if (c.version != ch.version + 1) {
+                count(CHEAD_FAIL);
+                return false;
+            }
+            Field f = Field(ch.version + 1, 0);
+            field_max(nb.cons(), f);
+            field_max(nb.resv(), f);
+        }
+        field_max(chead, next(ch));
+        count(CHEAD_ADVANCE);
+        watermark();
+        return true;
+    }
+
+private:
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> phead;
+    /* version of block 0 in the round reset() started, read with phead and
+     * only written while the queue is idle */
+    uint64_t base = 0;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> chead;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> lost{0};
+    alignas(CACHELINE_SIZE) EventCount not_empty;
+    alignas(CACHELINE_SIZE) EventCount not_full;
+};
+
+/* queue with capacity of N and B blocks fixed at compile time, laid out as
+ * the layout option says, Interleaved by default */
+template<class T, size_t N, size_t B, class... Options>
+using Queue = BasicQueue<T, StaticBlocks<
+    typename select_option<option::residence, NoResidence, Options...>::type::template entry<T>, N, B,
+    typename select_option<option::layout, Interleaved, Options...>::type>, Options...>;
+
+/* queue sized at construction, DynamicQueue<T>(capacity, blocks[, alloc]),
+ * its blocks come from the allocator option, HeapAllocator by default */
+template<class T, class... Options>
+using DynamicQueue = BasicQueue<T, DynamicBlocks<
+    typename select_option<option::residence, NoResidence, Options...>::type::template entry<T>,
+    typename select_option<option::allocator, HeapAllocator, Options...>::type,
+    typename select_option<option::layout, Interleaved, Options...>::type>, Options...>;
+
+/* Queue of variable-length byte records, sized at construction,
+ * RecordQueue<>(capacity, blocks[, alloc]) with capacity in bytes. Each
+ * block is a byte buffer, and alloc, comm, resv and cons count bytes:
+ * a producer claims an 8 byte header plus the record rounded up to 8
+ * bytes with a CAS on alloc, and a record that does not fit closes the
+ * block, the producer pads out its rest and moves on through
+ * advance_phead. Consumers read the header at resv to learn how far to
+ * move it and get (data, size) views of the records in place. Any number
+ * of producers and consumers, retry-new only. */
+template<class... Options>
+class RecordQueue : private DynamicBlocks<unsigned char,
+                                          typename select_option<option::allocator, HeapAllocator, Options...>::type,
+                                          typename select_option<option::layout, Interleaved, Options...>::type> {
+
+    using Storage = DynamicBlocks<unsigned char,
+                                  typename select_option<option::allocator, HeapAllocator, Options...>::type,
+                                  typename select_option<option::layout, Interleaved, Options...>::type>;
+    using Block = typename Storage::Block;
+    using Storage::NE;
+    using Storage::B;
+    using Storage::block;
+
+    static_assert(!std::is_same<typename select_option<option::mode, RetryNew, Options...>::type, DropOld>::value,
+                  "records can not be dropped, a consumer would not find the next header");
+
+    /* in front of every record, padding fills the rest of a closed block */
+    struct Header {
+        uint32_t size;
+        uint32_t padding;
+    };
+    static constexpr size_t HDR = sizeof(Header);
+
+    static size_t footprint(size_t size) {
+        return HDR + (size + HDR - 1) / HDR * HDR;
+    }
+
+public:
+    template<class... Args>
+    explicit RecordQueue(size_t capacity, size_t blocks, Args&&... args)
+        : Storage(capacity, blocks, std::forward<Args>(args)...) {
+        if (NE % HDR != 0 || NE < 2 * HDR) {
+            throw std::invalid_argument("blocks must be a multiple of 8 bytes of at least 16");
+        }
+        // zero counters, the blocks after block 0 are untouched until used
+        uint64_t f = Field(0, 0).raw();
+        bbq_store_rlx(phead, f);
+        bbq_store_rlx(chead, f);
+    }
+
+    /* largest record that fits in a block */
+    size_t max_size() const {
+        return NE - HDR;
+    }
+
+    /* room for one record of the size asked for, write into data() and
+     * commit(). A slot abandoned without commit() turns its room into
+     * padding, which consumers skip like the rest of a closed block. */
+    class Slot {
+    public:
+        Slot() : q(nullptr), b(), index(0), len(0) {}
+        Slot(Slot&& o) : q(o.q), b(o.b), index(o.index), len(o.len) { o.b = Block(); }
+        Slot& operator=(Slot&& o) {
+            if (this != &o) {
+                abandon();
+                q = o.q;
+                b = o.b;
+                index = o.index;
+                len = o.len;
+                o.b = Block();
+            }
+            return *this;
+        }
+        ~Slot() { abandon(); }
+
+        explicit operator bool() const { return bool(b); }
+        void* data() const { return q->bytes(b) + index + HDR; }
+        size_t size() const { return len; }
+        void commit() {
+            if (b) {
+                q->publish(b, footprint(len));
+                b = Block();
+            }
+        }
+
+    private:
+        void abandon() {
+            if (b) {
+                Header h{(uint32_t)(footprint(len) - HDR), 1};
+                memcpy(q->bytes(b) + index, &h, HDR);
+                commit();
+            }
+        }
+
+        friend class RecordQueue;
+        Slot(RecordQueue* q, Block b, uint64_t index, size_t len) : q(q), b(b), index(index), len(len) {}
+        RecordQueue* q;
+        Block b;
+        uint64_t index;
+        size_t len;
+    };
+
+    /* a record in place, retired when released or destroyed */
+    class View {
+    public:
+        View() : q(nullptr), b(), index(0), len(0) {}
+        View(View&& o) : q(o.q), b(o.b), index(o.index), len(o.len) { o.b = Block(); }
+        View& operator=(View&& o) {
+            if (this != &o) {
+                release();
+                q = o.q;
+                b = o.b;
+                index = o.index;
+                len = o.len;
+                o.b = Block();
+            }
+            return *this;
+        }
+        ~View() { release(); }
+
+        explicit operator bool() const { return bool(b); }
+        const void* data() const { return q->bytes(b) + index + HDR; }
+        size_t size() const { return len; }
+        void release() {
+            if (b) {
+                q->retire(b, footprint(len));
+                b = Block();
+            }
+        }
+
+    private:
+        friend class RecordQueue;
+        View(RecordQueue* q, Block b, uint64_t index, size_t len) : q(q), b(b), index(index), len(len) {}
+        RecordQueue* q;
+        Block b;
+        uint64_t index;
+        size_t len;
+    };
+
+    /* an empty Slot if the queue is full; size must be at most max_size() */
+    Slot try_reserve(size_t size) {
+        if (size > max_size()) {
+            throw std::length_error("record larger than a block");
+        }
+        std::pair<Block, uint64_t> e = allocate(footprint(size));
+        if (!e.first) {
+            return Slot();
+        }
+        Header h{(uint32_t)size, 0};
+        memcpy(bytes(e.first) + e.second, &h, HDR);
+        return Slot(this, e.first, e.second, size);
+    }
+
+    /* copies size bytes from data in, false if the queue is full */
+    bool enqueue(const void* data, size_t size) {
+        Slot s = try_reserve(size);
+        if (!s) {
+            return false;
+        }
+        memcpy(s.data(), data, size);
+        s.commit();
+        return true;
+    }
+
+    /* an empty View if no record is ready */
+    View try_view() {
+        std::pair<Block, uint64_t> e;
+        size_t size;
+        if (!reserve(e, size)) {
+            return View();
+        }
+        return View(this, e.first, e.second, size);
+    }
+
+    /* calls f(data, size) on the next record, false if there is none */
+    template<class F>
+    bool dequeue(F&& f) {
+        View v = try_view();
+        if (!v) {
+            return false;
+        }
+        f(v.data(), v.size());
+        return true;
+    }
+
+    /* blocking versions, sleeping on a futex like the MPMC queue's */
+    Slot reserve_wait(size_t size) {
+        Slot s;
+        wait_until(not_full, [&] { return bool(s = try_reserve(size)); }, nullptr, [](unsigned) { cpu_relax(); });
+        return s;
+    }
+    View view_wait() {
+        View v;
+        wait_until(not_empty, [&] { return bool(v = try_view()); }, nullptr, [](unsigned) { cpu_relax(); });
+        return v;
+    }
+
+private:
+    unsigned char* bytes(Block b) const {
+        return reinterpret_cast<unsigned char*>(b.data());
+    }
+
+    Field next(Field f) const {
+        if ((uint64_t)f.index + 1 == B) {
+            return Field(f.version + 1, 0);
+        }
+        return Field(f.version, f.index + 1);
+    }
+
+    /* claims n bytes in the phead block, a null Block if the queue is full */
+    std::pair<Block, uint64_t> allocate(uint64_t n) {
+        while (true) {
+            Field ph(bbq_load_acq(phead));
+            Block b = block(ph.index);
+            Field a(bbq_load_rlx(b.alloc()));
+            while (a.index < NE) {
+                if (a.index + n <= NE) {
+                    if (field_cas(b.alloc(), a, a + n)) {
+                        return std::make_pair(b, (uint64_t)a.index);
+                    }
+                    continue;
+                }
+                // a CAS rather than an add: the block is closed exactly
+                // once, by whoever pads out its rest
+                if (field_cas(b.alloc(), a, Field(a.version, NE))) {
+                    uint64_t rest = NE - a.index;
+                    if (rest >= HDR) {
+                        Header h{(uint32_t)(rest - HDR), 1};
+                        memcpy(bytes(b) + a.index, &h, HDR);
+                    }
+                    publish(b, rest);
+                    break;
+                }
+            }
+            if (!advance_phead(ph)) {
+                return std::make_pair(Block(), 0);
+            }
+        }
+    }
+
+    /* the next record of the chead block, skipping padding */
+    bool reserve(std::pair<Block, uint64_t>& e, size_t& size) {
+        while (true) {
+            Field ch(bbq_load_acq(chead));
+            Block b = block(ch.index);
+            Field r(bbq_load_acq(b.resv()));
+            if (r.index >= NE) {
+                if (!advance_chead(ch)) {
+                    return false;
+                }
+                continue;
+            }
+            Field c(bbq_load_acq(b.comm()));
+            if (r.index == c.index) {
+                return false;
+            }
+            // everything below c is committed once no allocation is open
+            if (c.index != NE) {
+                Field a(bbq_load_acq(b.alloc()));
+                if (a.index != c.index) {
+                    return false;
+                }
+            }
+            // the header is only known to be intact if the CAS below wins,
+            // until then nobody has retired it
+            uint64_t n = NE - r.index;
+            Header h = {0, 1};
+            if (n >= HDR) {
+                memcpy(&h, bytes(b) + r.index, HDR);
+                n = h.padding ? HDR + h.size : footprint(h.size);
+                n = std::min<uint64_t>(n, NE - r.index);
+            }
+            if (!field_cas(b.resv(), r, r + n)) {
+                continue;
+            }
+            if (h.padding) {
+                retire(b, n);
+                continue;
+            }
+            e = std::make_pair(b, (uint64_t)r.index);
+            size = h.size;
+            return true;
+        }
+    }
+
+    void publish(Block b, uint64_t n) {
+        field_faa(b.comm(), n, std::memory_order_seq_cst);
+        not_empty.notify();
+    }
+
+    void retire(Block b, uint64_t n) {
+        Field old = field_faa(b.cons(), n, std::memory_order_seq_cst);
+        if (old.index + n == NE) {
+            not_full.notify();
+        }
+    }
+
+    bool advance_phead(Field ph) {
+        Block nb = block((ph.index + 1) % B);
+        // the previous round of nb must be fully consumed before reuse, in
+        // the first round there was none
+        Field c(bbq_load_acq(nb.cons()));
+        bool fresh = ph.version == 0 && (uint64_t)ph.index + 1 < B;
+        if (!fresh && (c.version < ph.version || (c.version == ph.version && c.index != NE))) {
+            return false;
+        }
+        Field f = Field(ph.version + 1, 0);
+        field_max(nb.comm(), f);
+        field_max(nb.alloc(), f);
+        field_max(phead, next(ph));
+        return true;
+    }
+
+    bool advance_chead(Field ch) {
+        Block nb = block((ch.index + 1) % B);
+        Field c(bbq_load_acq(nb.comm()));
+        if (c.version != ch.version + 1) {
+            return false;
+        }
+        Field f = Field(ch.version + 1, 0);
+        field_max(nb.cons(), f);
+        field_max(nb.resv(), f);
+        field_max(chead, next(ch));
+        return true;
+    }
+
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> phead;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> chead;
+    alignas(CACHELINE_SIZE) EventCount not_empty;
+    alignas(CACHELINE_SIZE) EventCount not_full;
+};
+
+}
+
+namespace Broadcast {
+
+/* Block based queue with capacity of N and B blocks, one producer thread
+ * and up to S subscribers, each of which reads every entry: an entry is
+ * written once and copied out by every subscriber, so T must be trivially
+ * copyable.
+ *
+ * Blocks are numbered in the order the producer fills them, block number g
+ * lives in blocks[g % B] as version g / B + 1, and each block's comm holds
+ * that version and the entries committed. A subscriber walks the blocks
+ * with a private cursor like the consumer of SPSC::Queue and publishes the
+ * number of the block it is in. Retry-new: the producer only reuses a
+ * block once the slowest subscriber has left it, and caches that slowest
+ * position, so it rescans the subscribers at most once per block. Drop-old:
+ * the producer never waits, it bumps the block's version before writing,
+ * and subscribers validate their copy against it like seqlock readers,
+ * jumping to the oldest intact block when they were lapped. */
+template<class T, size_t N, size_t B, size_t S, class... Options>
+class Queue {
+
+    static constexpr size_t NE = N / B;
+
+    static_assert(NE < (1UL << INDEX_BITS), "too many entries in one block");
+    static_assert(N % B == 0, "N % B must be 0");
+    static_assert(B >= 2, "the producer needs a block nobody reads");
+    static_assert(std::is_trivially_copyable<T>::value, "subscribers copy entries, T must be trivially copyable");
+
+    using Mode = typename select_option<option::mode, RetryNew, Options...>::type;
+    static constexpr bool DROP_OLD = std::is_same<Mode, DropOld>::value;
+
+    struct Block {
+        /* written by the producer: version and entries committed so far */
+        alignas(CACHELINE_SIZE) std::atomic<uint64_t> comm;
+        alignas(CACHELINE_SIZE) RawEntry<T> data[NE];
+    } __attribute__((aligned(CACHELINE_SIZE)));
+
+    /* the block a subscriber is in, FREE for an unused slot */
+    struct alignas(CACHELINE_SIZE) Position {
+        std::atomic<uint64_t> block{FREE};
+    };
+    static constexpr uint64_t FREE = ~0UL;
+
+    static uint64_t version(uint64_t g) {
+        return g / B + 1;
+    }
+
+public:
+    Queue() {
+        for (uint64_t i = 0; i < B; i++) {
+            bbq_store_rlx(blocks[i].comm, Field(0, NE).raw());
+        }
+        bbq_store_rlx(blocks[0].comm, Field(version(0), 0).raw());
+        bbq_store_rlx(phead, 0);
+    }
+
+    /* a subscriber's cursor, reads from one thread, unsubscribes when
+     * destroyed, which must happen before the queue is */
+    class Subscriber {
+    public:
+        Subscriber() : q(nullptr) {}
+        Subscriber(Subscriber&& o) : q(o.q), slot(o.slot), cur(o.cur), lost(o.lost) { o.q = nullptr; }
+        Subscriber& operator=(Subscriber&& o) {
+            if (this != &o) {
+                leave();
+                q = o.q;
+                slot = o.slot;
+                cur = o.cur;
+                lost = o.lost;
+                o.q = nullptr;
+            }
+            return *this;
+        }
+        ~Subscriber() { leave(); }
+
+        explicit operator bool() const { return q != nullptr; }
+
+        /* the next entry, false if the producer has not committed it yet */
+        bool dequeue(T& t) {
+            return dequeue_bulk(&t, 1) == 1;
+        }
+
+        /* up to max entries into dst, returns the number read */
+        size_t dequeue_bulk(T* dst, size_t max) {
+            size_t done = 0;
+            while (done < max) {
+                if (cur.entry == cur.limit && !q->refill(*this)) {
+                    break;
+                }
+                uint64_t cnt = std::min<uint64_t>(max - done, cur.limit - cur.entry);
+                Block* b = &q->blocks[cur.block % B];
+                T* first = b->data[cur.entry].get();
+                if constexpr (std::is_trivially_copyable<T>::value) {
+                    copy_entries(dst + done, first, cnt, false);
+                } else {
+                    std::copy(first, first + cnt, dst + done);
+                }
+                if constexpr (DROP_OLD) {
+                    // copy first, then check the producer did not take the
+                    // block over meanwhile
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (Field(bbq_load_rlx(b->comm)).version != version(cur.block)) {
+                        q->resync(*this);
+                        continue;
+                    }
+                }
+                cur.entry += cnt;
+                done += cnt;
+            }
+            return done;
+        }
+
+        /* drop-old: entries this subscriber missed because it was lapped */
+        uint64_t dropped() const {
+            static_assert(DROP_OLD, "only drop-old queues drop entries");
+            return lost;
+        }
+
+    private:
+        friend class Queue;
+        struct Cursor {
+            uint64_t block;
+            uint64_t entry;
+            /* entries of the block known to be committed */
+            uint64_t limit;
+        };
+        Subscriber(Queue* q, size_t slot, uint64_t g) : q(q), slot(slot), cur{g, 0, 0}, lost(0) {}
+        void leave() {
+            if (q) {
+                bbq_store_rel(q->subscribers[slot].block, FREE);
+                q = nullptr;
+            }
+        }
+
+        Queue* q;
+        size_t slot;
+        Cursor cur;
+        uint64_t lost;
+    };
+
+    /* a new subscriber starting at the beginning of the block the producer
+     * is in, an empty one if all S are taken */
+    Subscriber subscribe() {
+        for (size_t i = 0; i < S; i++) {
+            uint64_t expected = FREE;
+            uint64_t g = bbq_load_acq(phead);
+            if (!subscribers[i].block.compare_exchange_strong(expected, g, std::memory_order_seq_cst)) {
+                continue;
+            }
+            // the producer may have moved on before it could see us, follow
+            // it until it is seen to stand still
+            uint64_t now;
+            while ((now = bbq_load_acq(phead)) != g) {
+                g = now;
+                subscribers[i].block.store(g, std::memory_order_seq_cst);
+            }
+            return Subscriber(this, i, g);
+        }
+        return Subscriber();
+    }
+
+    /* producer only; retry-new: false while the slowest subscriber is still
+     * in the block the producer has to reuse */
+    bool enqueue(const T& t) {
+        return enqueue_bulk(&t, 1) == 1;
+    }
+
+    /* producer only: one store to comm per block, returns the number
+     * enqueued, fewer than n once a retry-new queue is full */
+    size_t enqueue_bulk(const T* src, size_t n) {
+        size_t done = 0;
+        while (done < n) {
+            if (prod.entry == NE && !advance_phead()) {
+                break;
+            }
+            Block* b = &blocks[prod.block % B];
+            uint64_t cnt = std::min<uint64_t>(n - done, NE - prod.entry);
+            construct_entries(reinterpret_cast<T*>(b->data[prod.entry].bytes), src + done, cnt,
+                              stream_block(NE * sizeof(T)));
+            prod.entry += cnt;
+            bbq_store_rel(b->comm, Field(version(prod.block), prod.entry).raw());
+            done += cnt;
+        }
+        return done;
+    }
+
+private:
+    /* the only place the producer reads the subscribers' positions */
+    bool advance_phead() {
+        uint64_t g = prod.block + 1;
+        if constexpr (!DROP_OLD) {
+            // blocks[g % B] last held block g - B, everyone must be past it
+            if (g >= B && slowest <= g - B) {
+                // whoever subscribes later starts at phead, the block we are in
+                slowest = prod.block;
+                for (size_t i = 0; i < S; i++) {
+                    // seq_cst: against subscribe()'s slot CAS and phead load
+                    slowest = std::min<uint64_t>(slowest, subscribers[i].block.load(std::memory_order_seq_cst));
+                }
+                if (slowest <= g - B) {
+                    return false;
+                }
+            }
+        }
+        Block* nb = &blocks[g % B];
+        bbq_store_rlx(nb->comm, Field(version(g), 0).raw());
+        // drop-old: the new version is out before any entry is overwritten
+        std::atomic_thread_fence(std::memory_order_release);
+        prod.block = g;
+        prod.entry = 0;
+        // seq_cst: subscribe() relies on seeing phead move once it is listed
+        phead.store(g, std::memory_order_seq_cst);
+        return true;
+    }
+
+    /* reloads comm once the entries seen last time are read */
+    bool refill(Subscriber& s) {
+        typename Subscriber::Cursor& c = s.cur;
+        while (true) {
+            if (c.entry == NE) {
+                Field f(bbq_load_acq(blocks[(c.block + 1) % B].comm));
+                if (f.version < version(c.block + 1)) {
+                    // the producer has not reached the next block yet
+                    return false;
+                }
+                if (DROP_OLD && f.version > version(c.block + 1)) {
+                    resync(s);
+                    continue;
+                }
+                c = typename Subscriber::Cursor{c.block + 1, 0, 0};
+                if constexpr (!DROP_OLD) {
+                    // hands the previous block back to the producer
+                    bbq_store_rel(subscribers[s.slot].block, c.block);
+                }
+            }
+            Field f(bbq_load_acq(blocks[c.block % B].comm));
+            if (f.version != version(c.block)) {
+                if (f.version < version(c.block)) {
+                    return false;
+                }
+                // drop-old: lapped
+                resync(s);
+                continue;
+            }
+            c.limit = f.index;
+            return c.entry != c.limit;
+        }
+    }
+
+    /* drop-old: s was lapped, skip to the oldest block that stays intact
+     * while the producer fills its current one */
+    void resync(Subscriber& s) {
+        uint64_t g = std::max<uint64_t>(bbq_load_acq(phead) + 2, B) - B;
+        g = std::max<uint64_t>(g, s.cur.block + 1);
+        s.lost += (g - s.cur.block) * NE - s.cur.entry;
+        s.cur = typename Subscriber::Cursor{g, 0, 0};
+        // remembered for debugging, the producer does not wait for it
+        bbq_store_rlx(subscribers[s.slot].block, g);
+    }
+
+    struct Cursor {
+        uint64_t block;
+        uint64_t entry;
+    };
+
+    alignas(CACHELINE_SIZE) Block blocks[B];
+    alignas(CACHELINE_SIZE) Cursor prod{0, 0};
+    /* producer only: a lower bound of the positions of the subscribers,
+     * present and future */
+    uint64_t slowest = 0;
+    /* block number the producer is in, for subscribe() and resync() */
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> phead;
+    Position subscribers[S];
+};
+
+}
+
 }
 }
-}
\ No newline at end of file
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "bbq.h"
+
+namespace PEX {
+namespace BBQ {
+
+/* A small callable, stored inline: anything trivially copyable of up to 56
+ * bytes, typically a lambda capturing a few pointers or integers, so that
+ * tasks move between queues as plain bytes and never allocate. */
+class Task {
+public:
+    Task() = default;
+
+    template<class F>
+    explicit Task(F f) {
+        static_assert(std::is_trivially_copyable<F>::value, "a task must be trivially copyable");
+        static_assert(sizeof(F) <= sizeof(buf) && alignof(F) <= alignof(void*), "a task must fit in 56 bytes");
+        new (buf) F(f);
+        call = [](Task& t) { (*std::launder(reinterpret_cast<F*>(t.buf)))(); };
+    }
+
+    void operator()() { call(*this); }
+
+private:
+    void (*call)(Task&) = nullptr;
+    alignas(void*) unsigned char buf[56];
+};
+static_assert(sizeof(Task) == CACHELINE_SIZE, "a task is one cache line");
+
+/* Thread pool where every worker owns a single-producer MPMC queue of
+ * tasks. Tasks submitted by a worker go to its own queue, the others to a
+ * shared injection queue. A worker runs its own tasks first, then takes a
+ * batch from the injection queue, then steals: it reserves the rest of a
+ * victim's current block with one resv CAS and retires it with one cons
+ * add (drain_block), so a thief takes up to capacity / blocks tasks per
+ * handoff instead of one. Idle workers sleep on a futex, and submitting
+ * costs one load on top of the enqueue while nobody sleeps. Tasks must not
+ * throw. */
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t workers = std::thread::hardware_concurrency(),
+                              size_t capacity = 4096, size_t blocks = 64)
+        : block(capacity / blocks), inject(capacity, blocks) {
+        if (workers == 0) {
+            throw std::invalid_argument("a pool needs at least one worker");
+        }
+        for (size_t i = 0; i < workers; i++) {
+            threads.emplace_back(new Worker(i, capacity, blocks, block));
+        }
+        for (size_t i = 0; i < workers; i++) {
+            threads[i]->thread = std::thread([this, i] { run(*threads[i]); });
+        }
+    }
+
+    /* runs everything submitted so far, then stops the workers */
+    ~WorkStealingPool() {
+        wait_idle();
+        stopping.store(true, std::memory_order_seq_cst);
+        work.notify();
+        for (auto& w : threads) {
+            w->thread.join();
+        }
+    }
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    /* queues f, from a worker onto its own queue, or runs it right away if
+     * both that and the injection queue are full; from any other thread
+     * onto the injection queue, waiting while it is full */
+    template<class F>
+    void submit(F f) {
+        Task t(f);
+        pending.fetch_add(1, std::memory_order_relaxed);
+        Worker* w = current();
+        if (w) {
+            if (!w->local.enqueue(t) && !inject.enqueue(t)) {
+                execute(t);
+                return;
+            }
+        } else {
+            inject.enqueue_wait(t);
+        }
+        work.notify();
+    }
+
+    /* blocks until every submitted task has run, not from a worker */
+    void wait_idle() {
+        wait_until(idle, [&] { return bbq_load_acq(pending) == 0; }, nullptr, [](unsigned) { cpu_relax(); });
+    }
+
+    size_t size() const {
+        return threads.size();
+    }
+
+private:
+    struct Worker {
+        Worker(size_t index, size_t capacity, size_t blocks, size_t block)
+            : index(index), local(capacity, blocks), buffer(new Task[block]) {}
+        const size_t index;
+        MPMC::DynamicQueue<Task, SingleProducer> local;
+        /* stolen or injected tasks being run, one block's worth */
+        std::unique_ptr<Task[]> buffer;
+        const WorkStealingPool* pool = nullptr;
+        std::thread thread;
+    };
+
+    static Worker*& self() {
+        static thread_local Worker* w = nullptr;
+        return w;
+    }
+
+    /* the calling thread's worker if it is one of ours */
+    Worker* current() const {
+        Worker* w = self();
+        return w && w->pool == this ? w : nullptr;
+    }
+
+    void run(Worker& w) {
+        w.pool = this;
+        self() = &w;
+        while (true) {
+            wait_until(work, [&] { return find(w) || bbq_load_acq(stopping); }, nullptr,
+                       [](unsigned) { cpu_relax(); });
+            if (bbq_load_acq(stopping)) {
+                return;
+            }
+        }
+    }
+
+    /* runs some tasks, false if there were none to be found */
+    bool find(Worker& w) {
+        Task t;
+        if (w.local.dequeue(t)) {
+            execute(t);
+            return true;
+        }
+        size_t n = inject.dequeue_bulk(w.buffer.get(), block);
+        if (n == 0) {
+            n = steal(w);
+        }
+        for (size_t i = 0; i < n; i++) {
+            execute(w.buffer[i]);
+        }
+        return n != 0;
+    }
+
+    /* a block of tasks from the first victim after w that has one */
+    size_t steal(Worker& w) {
+        size_t workers = threads.size();
+        for (size_t k = 1; k < workers; k++) {
+            Worker& v = *threads[(w.index + k) % workers];
+            size_t n = v.local.drain_block([&](Task* first, size_t cnt) {
+                std::copy(first, first + cnt, w.buffer.get());
+            });
+            if (n) {
+                return n;
+            }
+        }
+        return 0;
+    }
+
+    void execute(Task& t) {
+        t();
+        if (pending.fetch_sub(1, std::memory_order_seq_cst) == 1) {
+            idle.notify();
+        }
+    }
+
+    const size_t block;
+    std::vector<std::unique_ptr<Worker>> threads;
+    MPMC::DynamicQueue<Task> inject;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> pending{0};
+    alignas(CACHELINE_SIZE) std::atomic<bool> stopping{false};
+    alignas(CACHELINE_SIZE) EventCount work;
+    alignas(CACHELINE_SIZE) EventCount idle;
+};
+
+}
+}
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#include "bbq.h"
+
+namespace PEX {
+namespace BBQ {
+namespace SPSC {
+
+/* Fan-in over many SPSC::Queue<T, N, B>, one per producer thread, to a
+ * single consumer thread.
+ *
+ * A bitmap, one bit per queue, marks the queues that may hold entries, so
+ * the consumer only looks at those: it finds them with a count of trailing
+ * zeros per 64 queues and drains each with the bulk API. A queue's bit is
+ * set by its producer and cleared by the consumer once it found the queue
+ * empty. Producers do not touch the bitmap, or any line the consumer
+ * writes per entry, while their queue is non-empty: the consumer arms a
+ * queue's own flag when it empties it, and only the first commit after
+ * that sets the bit and wakes a consumer sleeping in the _wait calls. */
+template<class T, size_t N, size_t B>
+class QueueSet {
+public:
+    explicit QueueSet(size_t queues)
+        : count(queues), words((queues + 63) / 64), members(new Member[queues]),
+          bits(new Word[words]) {
+        if (queues == 0) {
+            throw std::invalid_argument("a queue set needs at least one queue");
+        }
+        for (size_t i = 0; i < words; i++) {
+            bbq_store_rlx(bits[i].v, 0);
+        }
+    }
+    QueueSet(const QueueSet&) = delete;
+    QueueSet& operator=(const QueueSet&) = delete;
+
+    size_t size() const {
+        return count;
+    }
+
+    /* producer of queue i only, false if that queue is full */
+    bool enqueue(size_t i, const T& t) {
+        return emplace(i, t);
+    }
+    bool enqueue(size_t i, T&& t) {
+        return emplace(i, std::move(t));
+    }
+    template<class... Args>
+    bool emplace(size_t i, Args&&... args) {
+        if (!members[i].q.emplace(std::forward<Args>(args)...)) {
+            return false;
+        }
+        signal(i);
+        return true;
+    }
+    /* one signal for the whole run, returns the number enqueued */
+    size_t enqueue_bulk(size_t i, const T* src, size_t n) {
+        size_t done = members[i].q.enqueue_bulk(src, n);
+        if (done) {
+            signal(i);
+        }
+        return done;
+    }
+
+    /* consumer only: dequeues up to max entries from the queues marked
+     * non-empty, in turn from where the last call stopped, returns the
+     * number dequeued, 0 if every queue was empty */
+    size_t dequeue_bulk(T* dst, size_t max) {
+        size_t done = 0;
+        size_t i;
+        while (done < max && next(i)) {
+            Member& m = members[i];
+            done += m.q.dequeue_bulk(dst + done, max - done);
+            cursor = i + 1 == count ? 0 : i + 1;
+            if (done < max) {
+                // the queue is empty, let its producer mark it again
+                disarm_check(i);
+            }
+        }
+        return done;
+    }
+
+    /* dequeue_bulk, but sleeps on a futex while every queue is empty, so
+     * at least one entry is returned */
+    size_t dequeue_bulk_wait(T* dst, size_t max) {
+        size_t done = 0;
+        wait_until(nonempty, [&] { return (done = dequeue_bulk(dst, max)) != 0; }, nullptr,
+                   [](unsigned) { cpu_relax(); });
+        return done;
+    }
+
+    /* dequeue_bulk_wait giving up after d, 0 if it did */
+    template<class Rep, class Period>
+    size_t dequeue_bulk_for(T* dst, size_t max, const std::chrono::duration<Rep, Period>& d) {
+        timespec deadline = to_timespec(std::chrono::steady_clock::now() + d);
+        size_t done = 0;
+        wait_until(nonempty, [&] { return (done = dequeue_bulk(dst, max)) != 0; }, &deadline,
+                   [](unsigned) { cpu_relax(); });
+        return done;
+    }
+
+private:
+    struct Member {
+        Queue<T, N, B> q;
+        /* set by the consumer once it found q empty, taken by the producer
+         * that commits next, which then sets q's bit */
+        alignas(CACHELINE_SIZE) std::atomic<bool> armed{true};
+    };
+
+    struct alignas(CACHELINE_SIZE) Word {
+        std::atomic<uint64_t> v;
+    };
+
+    /* after a commit to queue i: mark it if the consumer asked for that */
+    void signal(size_t i) {
+        // the commit against the consumer's arm-then-recheck, as in a
+        // Dekker handshake
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Member& m = members[i];
+        if (bbq_load_rlx(m.armed) && m.armed.exchange(false, std::memory_order_acquire)) {
+            bits[i / 64].v.fetch_or(1UL << (i % 64), std::memory_order_seq_cst);
+            nonempty.notify();
+        }
+    }
+
+    /* the consumer found queue i empty: clears its bit and arms it, unless
+     * an entry came in meanwhile */
+    void disarm_check(size_t i) {
+        Member& m = members[i];
+        bits[i / 64].v.fetch_and(~(1UL << (i % 64)), std::memory_order_relaxed);
+        // release: the producer that takes the flag sets the bit after this clear
+        m.armed.store(true, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!m.q.empty() && m.armed.exchange(false, std::memory_order_relaxed)) {
+            // its producer missed the flag, mark it ourselves
+            bits[i / 64].v.fetch_or(1UL << (i % 64), std::memory_order_relaxed);
+        }
+    }
+
+    /* the first marked queue at or after cursor, round-robin */
+    bool next(size_t& i) {
+        size_t w = cursor / 64;
+        uint64_t word = bbq_load_acq(bits[w].v) & (~0UL << (cursor % 64));
+        for (size_t k = 0; k <= words; k++) {
+            if (word) {
+                i = w * 64 + __builtin_ctzl(word);
+                return true;
+            }
+            w = w + 1 == words ? 0 : w + 1;
+            word = bbq_load_acq(bits[w].v);
+        }
+        return false;
+    }
+
+    const size_t count;
+    const size_t words;
+    std::unique_ptr<Member[]> members;
+    std::unique_ptr<Word[]> bits;
+    alignas(CACHELINE_SIZE) size_t cursor = 0;  // consumer only
+    alignas(CACHELINE_SIZE) EventCount nonempty;
+};
+
+}
+
+/* one lane of a PriorityQueueSet: an MPMC::Queue<T, N, B, Options...>
+ * that gets Weight entries per round under WEIGHTED_ROUND_ROBIN */
+template<size_t N, size_t B, unsigned Weight = 1, class... Options>
+struct Lane {
+    static_assert(Weight > 0, "a lane needs a weight of at least 1");
+    static constexpr unsigned WEIGHT = Weight;
+    template<class T>
+    using Queue = MPMC::Queue<T, N, B, Options...>;
+};
+
+/* how a PriorityQueueSet picks the lane to dequeue from */
+enum Schedule {
+    STRICT_PRIORITY,        // the first non-empty lane, lane 0 first
+    WEIGHTED_ROUND_ROBIN,   // up to each lane's weight in turn, a deficit
+                            // round robin where empty lanes keep no credit
+};
+
+/* Several MPMC queues, the lanes, drained by one consumer thread, for
+ * mixing say control messages and bulk data without the control messages
+ * waiting behind the bulk. Producers enqueue into a lane of their choice,
+ * any number of them. The consumer takes entries with the lanes' bulk or
+ * drain calls, so picking a lane is paid once per run of a block rather
+ * than once per entry: under STRICT_PRIORITY it empties the lanes in
+ * order, under WEIGHTED_ROUND_ROBIN it takes at most a lane's weight
+ * before moving to the next. Everything a call returns was taken in one
+ * pass, so an entry of lane 0 waits for at most one call's worth of
+ * lower-lane entries. lane<I>() gives the queue itself, for approx_size()
+ * and the other occupancy calls. */
+template<class T, class... Lanes>
+class PriorityQueueSet {
+public:
+    static constexpr size_t LANES = sizeof...(Lanes);
+    static_assert(LANES > 0, "a priority queue set needs at least one lane");
+
+    explicit PriorityQueueSet(Schedule schedule = STRICT_PRIORITY)
+        : schedule(schedule), weight{Lanes::WEIGHT...}, credit{Lanes::WEIGHT...} {}
+    PriorityQueueSet(const PriorityQueueSet&) = delete;
+    PriorityQueueSet& operator=(const PriorityQueueSet&) = delete;
+
+    template<size_t I>
+    auto& lane() {
+        return std::get<I>(lanes);
+    }
+
+    /* any thread, false if lane I is full */
+    template<size_t I>
+    bool enqueue(const T& t) {
+        return emplace<I>(t);
+    }
+    template<size_t I>
+    bool enqueue(T&& t) {
+        return emplace<I>(std::move(t));
+    }
+    template<size_t I, class... Args>
+    bool emplace(Args&&... args) {
+        if (!lane<I>().emplace(std::forward<Args>(args)...)) {
+            return false;
+        }
+        // the commit was a seq_cst add, as notify() needs
+        nonempty.notify();
+        return true;
+    }
+    template<size_t I>
+    size_t enqueue_bulk(const T* src, size_t n) {
+        size_t done = lane<I>().enqueue_bulk(src, n);
+        if (done) {
+            nonempty.notify();
+        }
+        return done;
+    }
+    /* the lane picked at run time */
+    bool enqueue(size_t i, const T& t) {
+        bool ok = false;
+        with_lane(lanes, i, [&](auto& q) { ok = q.enqueue(t); });
+        if (ok) {
+            nonempty.notify();
+        }
+        return ok;
+    }
+
+    /* entries in lane i, as its approx_size() */
+    size_t approx_size(size_t i) const {
+        size_t n = 0;
+        with_lane(lanes, i, [&](auto& q) { n = q.approx_size(); });
+        return n;
+    }
+
+    /* consumer only: dequeues up to max entries into dst as the schedule
+     * says, a run from each lane picked, returns the number dequeued */
+    size_t dequeue_bulk(T* dst, size_t max) {
+        return pick(max, [&](auto& q, size_t, size_t done, size_t want) {
+            return q.dequeue_bulk(dst + done, want);
+        });
+    }
+
+    /* consumer only: zero-copy, calls f(lane, first, n) on each run of n
+     * entries in place as the lane's drain() does, so the consumer can
+     * tell the lanes apart, returns the number drained */
+    template<class F>
+    size_t drain(F&& f, size_t max) {
+        return pick(max, [&](auto& q, size_t i, size_t, size_t want) {
+            return q.drain([&](T* first, size_t n) { f(i, first, n); }, want);
+        });
+    }
+
+    /* dequeue_bulk, but sleeps on a futex while every lane is empty, so at
+     * least one entry is returned */
+    size_t dequeue_bulk_wait(T* dst, size_t max) {
+        size_t done = 0;
+        wait_until(nonempty, [&] { return (done = dequeue_bulk(dst, max)) != 0; }, nullptr,
+                   [](unsigned) { cpu_relax(); });
+        return done;
+    }
+
+    /* dequeue_bulk_wait giving up after d, 0 if it did */
+    template<class Rep, class Period>
+    size_t dequeue_bulk_for(T* dst, size_t max, const std::chrono::duration<Rep, Period>& d) {
+        timespec deadline = to_timespec(std::chrono::steady_clock::now() + d);
+        size_t done = 0;
+        wait_until(nonempty, [&] { return (done = dequeue_bulk(dst, max)) != 0; }, &deadline,
+                   [](unsigned) { cpu_relax(); });
+        return done;
+    }
+
+private:
+    /* g(lane i of lanes), const or not */
+    template<class Tuple, class G, size_t... I>
+    static void with_lane(Tuple& lanes, size_t i, G&& g, std::index_sequence<I...>) {
+        ((i == I ? g(std::get<I>(lanes)) : void()), ...);
+    }
+    template<class Tuple, class G>
+    static void with_lane(Tuple& lanes, size_t i, G&& g) {
+        with_lane(lanes, i, g, std::index_sequence_for<Lanes...>());
+    }
+
+    /* the schedule over take(queue, lane, done, want), which takes up to
+     * want entries from the queue and returns how many it got */
+    template<class Take>
+    size_t pick(size_t max, Take&& take) {
+        size_t done = 0;
+        auto from = [&](size_t i, size_t want) {
+            size_t got = 0;
+            with_lane(lanes, i, [&](auto& q) { got = take(q, i, done, want); });
+            done += got;
+            return got;
+        };
+        if (schedule == STRICT_PRIORITY) {
+            for (size_t i = 0; i < LANES && done < max; i++) {
+                from(i, max - done);
+            }
+            return done;
+        }
+        // one pass over the lanes, from where the last call stopped
+        for (size_t k = 0; k < LANES && done < max; k++) {
+            size_t i = cursor;
+            size_t want = std::min<size_t>(credit[i], max - done);
+            size_t got = from(i, want);
+            if (got < want) {
+                // empty, an idle lane saves up no credit
+                credit[i] = weight[i];
+            } else if ((credit[i] -= got) == 0) {
+                credit[i] = weight[i];
+            } else {
+                // max reached with credit left, carry on here next call
+                break;
+            }
+            cursor = i + 1 == LANES ? 0 : i + 1;
+        }
+        return done;
+    }
+
+    const Schedule schedule;
+    std::tuple<typename Lanes::template Queue<T>...> lanes;
+    /* weighted round robin state, consumer only */
+    const unsigned weight[LANES];
+    unsigned credit[LANES];
+    size_t cursor = 0;
+    alignas(CACHELINE_SIZE) EventCount nonempty;
+};
+
+}
+}
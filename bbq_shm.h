@@ -0,0 +1,229 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bbq.h"
+
+namespace PEX {
+namespace BBQ {
+
+/* Header at offset 0 of a shared queue region, one cache line.
+ *
+ * Layout of the region (all offsets in bytes, little-endian, x86-64):
+ *
+ *   0                ShmHeader
+ *   64               MPMC::Queue<T, N, B, Options...>
+ *                      Interleaved: B blocks of Block::stride(N / B) bytes
+ *                      each, a block is four cache lines of counters (alloc,
+ *                      comm, resv, cons) followed by its N / B entries
+ *                      Separated: the alloc, comm, resv and cons arrays of
+ *                      B counters, each padded to two cache lines, then the
+ *                      N entries
+ *                      with ResidenceHistogram every entry is followed by
+ *                      its 8 byte commit timestamp, and the histogram
+ *                      shards come between the entries and phead
+ *                      then phead (sharing its line with the round the
+ *                      last reset() started), chead, the drop-old counter
+ *                      and the not_empty / not_full futex words, one cache
+ *                      line each
+ *                      blocks the producers have not reached yet are all
+ *                      zero bytes, whatever the layout
+ *   64 + queue_size  end of the region
+ *
+ * The queue holds no pointers, every counter is a lock-free
+ * std::atomic<uint64_t>, so it works at any address in any process. */
+struct ShmHeader {
+    /* "BBQ-SHM" followed by a zero byte */
+    static constexpr uint64_t MAGIC = 0x004d48532d514242UL;
+    /* bump whenever the layout above changes */
+    static constexpr uint32_t VERSION = 5;
+    /* values of state */
+    static constexpr uint32_t INITIALIZING = 0;
+    static constexpr uint32_t READY = 1;
+
+    uint64_t magic;
+    uint32_t version;
+    uint32_t drop_old;
+    uint64_t capacity;
+    uint64_t blocks;
+    uint64_t entry_size;
+    uint64_t queue_size;
+    std::atomic<uint32_t> state;
+    uint32_t separated;
+    uint32_t stamped;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+/* MPMC::Queue<T, N, B, Options...> in a shm_open'd object or a regular file
+ * mapped MAP_SHARED, so a producer process and a consumer process exchange
+ * entries with no syscall per message. create() builds it, attach() maps an
+ * existing one after checking its header against T, N, B, the mode and the
+ * layout. */
+template<class T, size_t N, size_t B, class... Options>
+class ShmQueue {
+public:
+    using Queue = MPMC::Queue<T, N, B, Options...>;
+
+    /* entries are copied between address spaces as bytes */
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "counters must be lock-free");
+    // the callback is a pointer into one process
+    static_assert(std::is_same<typename select_option<option::watermarks, NoWatermarks, Options...>::type,
+                               NoWatermarks>::value, "watermarks can not be shared between processes");
+
+    /* total size of the region */
+    static constexpr size_t SIZE = sizeof(ShmHeader) + sizeof(Queue);
+
+    /* creates or replaces the POSIX shared memory object name ("/name") */
+    static ShmQueue create(const char* name) {
+        return ShmQueue(check(shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600), "shm_open"), true);
+    }
+
+    /* maps the POSIX shared memory object name built by create() */
+    static ShmQueue attach(const char* name) {
+        return ShmQueue(check(shm_open(name, O_RDWR, 0), "shm_open"), false);
+    }
+
+    /* as create() and attach(), backed by the file at path */
+    static ShmQueue create_file(const char* path) {
+        return ShmQueue(check(open(path, O_RDWR | O_CREAT | O_TRUNC, 0600), "open"), true);
+    }
+    static ShmQueue attach_file(const char* path) {
+        return ShmQueue(check(open(path, O_RDWR), "open"), false);
+    }
+
+    /* removes the shared memory object, mappings stay valid */
+    static void unlink(const char* name) {
+        shm_unlink(name);
+    }
+
+    ShmQueue(ShmQueue&& o) : base(o.base) { o.base = nullptr; }
+    ShmQueue& operator=(ShmQueue&& o) {
+        std::swap(base, o.base);
+        return *this;
+    }
+    ShmQueue(const ShmQueue&) = delete;
+    ShmQueue& operator=(const ShmQueue&) = delete;
+    ~ShmQueue() {
+        if (base) {
+            munmap(base, SIZE);
+        }
+    }
+
+    Queue& queue() const {
+        return *reinterpret_cast<Queue*>(base + sizeof(ShmHeader));
+    }
+    Queue* operator->() const { return &queue(); }
+    Queue& operator*() const { return queue(); }
+
+private:
+    static constexpr uint32_t DROP_OLD =
+        std::is_same<typename select_option<option::mode, RetryNew, Options...>::type, DropOld>::value;
+    static constexpr uint32_t SEPARATED =
+        std::is_same<typename select_option<option::layout, Interleaved, Options...>::type, Separated>::value;
+    static constexpr uint32_t STAMPED =
+        !std::is_same<typename select_option<option::residence, NoResidence, Options...>::type, NoResidence>::value;
+
+    static int check(int fd, const char* what) {
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+        return fd;
+    }
+
+    ShmQueue(int fd, bool create) : base(nullptr) {
+        try {
+            if (create) {
+                if (ftruncate(fd, SIZE) != 0) {
+                    throw std::system_error(errno, std::generic_category(), "ftruncate");
+                }
+            } else {
+                struct stat st;
+                if (fstat(fd, &st) != 0) {
+                    throw std::system_error(errno, std::generic_category(), "fstat");
+                }
+                if ((size_t)st.st_size < SIZE) {
+                    throw std::runtime_error("shared queue region is too small");
+                }
+            }
+            void* p = mmap(nullptr, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "mmap");
+            }
+            base = static_cast<unsigned char*>(p);
+            close(fd);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        if (create) {
+            init();
+        } else {
+            validate();
+        }
+    }
+
+    ShmHeader* header() const {
+        return reinterpret_cast<ShmHeader*>(base);
+    }
+
+    void init() {
+        ShmHeader* h = new (base) ShmHeader();
+        h->magic = ShmHeader::MAGIC;
+        h->version = ShmHeader::VERSION;
+        h->drop_old = DROP_OLD;
+        h->separated = SEPARATED;
+        h->stamped = STAMPED;
+        h->capacity = N;
+        h->blocks = B;
+        h->entry_size = sizeof(T);
+        h->queue_size = sizeof(Queue);
+        // the region is fresh from ftruncate, so the blocks are zero already
+        new (base + sizeof(ShmHeader)) Queue(zeroed);
+        // attachers only look at the queue once they see READY
+        h->state.store(ShmHeader::READY, std::memory_order_release);
+    }
+
+    void validate() {
+        ShmHeader* h = header();
+        // the creator may still be building the queue, give it a second
+        for (int i = 0; h->state.load(std::memory_order_acquire) != ShmHeader::READY; i++) {
+            if (i == 1000) {
+                fail("shared queue was never initialized");
+            }
+            usleep(1000);
+        }
+        if (h->magic != ShmHeader::MAGIC) {
+            fail("not a shared queue");
+        }
+        if (h->version != ShmHeader::VERSION) {
+            fail("shared queue layout version mismatch");
+        }
+        if (h->capacity != N || h->blocks != B || h->entry_size != sizeof(T) ||
+            h->queue_size != sizeof(Queue) || h->drop_old != DROP_OLD ||
+            h->separated != SEPARATED || h->stamped != STAMPED) {
+            fail("shared queue was created with other parameters");
+        }
+    }
+
+    [[noreturn]] void fail(const char* why) {
+        munmap(base, SIZE);
+        base = nullptr;
+        throw std::runtime_error(why);
+    }
+
+    unsigned char* base;
+};
+
+}
+}
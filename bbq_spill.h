@@ -0,0 +1,325 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bbq.h"
+
+namespace PEX {
+namespace BBQ {
+
+/* MPMC::DynamicQueue<T, Options...> that overflows to disk instead of
+ * failing: an enqueue that finds the queue full (advance_phead says there
+ * is no free block) appends the entry to the spill, and so do all enqueues
+ * after it until consumers emptied the spill again, which keeps each
+ * producer's entries in order. Consumers take the in-memory entries first,
+ * those are older, then replay the spill in order, then go back to memory.
+ *
+ * The spill stages entries one block (capacity / blocks entries) at a time
+ * and appends whole blocks to segment files path.0, path.1, ... of
+ * segment_blocks blocks each, mapped MAP_SHARED with MADV_SEQUENTIAL.
+ * A written block is handed to the kernel for writeback with MADV_PAGEOUT
+ * where available, a block about to be replayed is read ahead with
+ * MADV_WILLNEED, replayed pages are punched out with MADV_REMOVE, and a
+ * replayed segment is unmapped and unlinked. The segments are scratch
+ * space, removed by the destructor, not a persistent log.
+ *
+ * The in-memory path costs one acquire load over the plain queue on each
+ * side. While spilling, every call on either side takes one mutex, so
+ * single-entry enqueue and dequeue serialize all threads on it, once per
+ * entry. enqueue_bulk and dequeue_bulk stage or replay a whole run per
+ * acquisition, use those where spilling is expected to last. */
+template<class T, class... Options>
+class SpillQueue {
+public:
+    using Queue = MPMC::DynamicQueue<T, Options...>;
+
+    /* entries go to disk as bytes */
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+    static_assert(std::is_same<typename select_option<option::mode, RetryNew, Options...>::type, RetryNew>::value,
+                  "a drop-old queue is never full, it has nothing to spill");
+
+    SpillQueue(size_t capacity, size_t blocks, std::string path, size_t segment_blocks = 1024)
+        : q(capacity, blocks), path(std::move(path)), block(capacity / blocks),
+          per_segment(block * segment_blocks), stage(new unsigned char[block * sizeof(T)]) {
+        if (segment_blocks == 0) {
+            throw std::invalid_argument("a spill segment needs at least one block");
+        }
+    }
+    ~SpillQueue() {
+        while (!segments.empty()) {
+            release_head();
+        }
+    }
+    SpillQueue(const SpillQueue&) = delete;
+    SpillQueue& operator=(const SpillQueue&) = delete;
+
+    /* never fails for lack of room, throws std::system_error if the spill
+     * can not grow, the entry is then not queued */
+    void enqueue(const T& t) {
+        if (!bbq_load_acq(spilling) && q.enqueue(t)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        overflow(&t, 1);
+    }
+
+    /* enqueue for n entries, whatever does not fit in memory goes to the
+     * spill under one lock; std::system_error leaves a prefix of src queued */
+    void enqueue_bulk(const T* src, size_t n) {
+        size_t done = bbq_load_acq(spilling) ? 0 : q.enqueue_bulk(src, n);
+        if (done < n) {
+            std::lock_guard<std::mutex> lock(mutex);
+            overflow(src + done, n - done);
+        }
+    }
+
+    /* false if both the queue and the spill are empty, or, as with the
+     * plain queue, while an entry in memory stays claimed but uncommitted */
+    bool dequeue(T& t) {
+        if (q.dequeue(t)) {
+            return true;
+        }
+        return bbq_load_acq(spilling) && unspill(&t, 1) == 1;
+    }
+
+    /* up to max entries into dst, from memory or else replayed from the
+     * spill under one lock, returns the number dequeued, 0 if both are
+     * empty */
+    size_t dequeue_bulk(T* dst, size_t max) {
+        size_t done = q.dequeue_bulk(dst, max);
+        if (done || !bbq_load_acq(spilling)) {
+            return done;
+        }
+        return unspill(dst, max);
+    }
+
+    /* entries waiting in the spill, staged or on disk */
+    size_t spilled() const {
+        return bbq_load_rlx(size);
+    }
+
+    /* entries in memory plus the spill, an estimate while others run */
+    size_t approx_size() const {
+        return q.approx_size() + spilled();
+    }
+
+    Queue& memory() {
+        return q;
+    }
+
+private:
+    struct Segment {
+        unsigned char* base;
+        size_t bytes;
+        std::string path;
+    };
+
+    static size_t page() {
+        static const size_t p = sysconf(_SC_PAGESIZE);
+        return p;
+    }
+
+    /* madvise over the whole pages inside [lo, hi) of base */
+    static void advise(unsigned char* base, size_t lo, size_t hi, int advice) {
+        size_t a = (lo + page() - 1) & ~(page() - 1);
+        size_t b = hi & ~(page() - 1);
+        if (a < b) {
+            madvise(base + a, b - a, advice);
+        }
+    }
+
+    Segment& segment(uint64_t seq) {
+        return segments[seq / per_segment - first];
+    }
+
+    /* holding the mutex: src goes to memory while there is room and no
+     * spill, the rest to the stage */
+    void overflow(const T* src, size_t n) {
+        if (!bbq_load_rlx(spilling)) {
+            // emptied since, there may be room again
+            size_t done = q.enqueue_bulk(src, n);
+            src += done;
+            n -= done;
+            if (n == 0) {
+                return;
+            }
+            bbq_store_rlx(spilling, true);
+        }
+        while (n) {
+            if (staged == block) {
+                flush();
+            }
+            size_t m = std::min(n, block - staged);
+            memcpy(stage.get() + staged * sizeof(T), src, m * sizeof(T));
+            staged += m;
+            bbq_store_rlx(size, bbq_load_rlx(size) + m);
+            src += m;
+            n -= m;
+        }
+    }
+
+    /* the slow path of the dequeues, the spill may hold entries */
+    size_t unspill(T* dst, size_t max) {
+        for (uint32_t i = 0; i < EventCount::MAX_SPIN; i++) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (q.approx_size() == 0) {
+                    return take(dst, max);
+                }
+            }
+            // entries from before the spill are still being committed,
+            // or came in since: they go first, and the spill waits behind
+            // them, so wait for their commit rather than report empty
+            cpu_relax();
+            size_t done = q.dequeue_bulk(dst, max);
+            if (done || !bbq_load_acq(spilling)) {
+                return done;
+            }
+        }
+        // a producer stalled between its alloc and commit holds up memory
+        // and the spill behind it, report empty as the plain queue does
+        return 0;
+    }
+
+    /* holding the mutex with memory empty: up to max entries from the
+     * segments, then the stage */
+    size_t take(T* dst, size_t max) {
+        size_t done = 0;
+        while (done < max && read < written) {
+            done += replay(dst + done, max - done);
+        }
+        if (done < max && stage_head < staged) {
+            size_t m = std::min(max - done, staged - stage_head);
+            memcpy(dst + done, stage.get() + stage_head * sizeof(T), m * sizeof(T));
+            stage_head += m;
+            done += m;
+        }
+        if (done == 0) {
+            // cleared since our load, the newest entries are in memory again
+            return q.dequeue_bulk(dst, max);
+        }
+        bbq_store_rlx(size, bbq_load_rlx(size) - done);
+        if (read == written && stage_head == staged) {
+            stage_head = staged = 0;
+            bbq_store_rel(spilling, false);
+        }
+        return done;
+    }
+
+    /* appends the unreplayed staged entries to the segments */
+    void flush() {
+        while (stage_head < staged) {
+            if (written / per_segment - first == segments.size()) {
+                open_segment();
+            }
+            Segment& s = segment(written);
+            size_t off = written % per_segment;
+            size_t n = std::min(staged - stage_head, per_segment - off);
+            memcpy(s.base + off * sizeof(T), stage.get() + stage_head * sizeof(T), n * sizeof(T));
+#ifdef MADV_PAGEOUT
+            // out of memory now rather than when reclaim gets to it
+            advise(s.base, off * sizeof(T), (off + n) * sizeof(T), MADV_PAGEOUT);
+#endif
+            written += n;
+            stage_head += n;
+        }
+        stage_head = staged = 0;
+    }
+
+    /* copies up to max entries from read on, within one segment, returns
+     * the number copied */
+    size_t replay(T* dst, size_t max) {
+        Segment& s = segment(read);
+        size_t off = read % per_segment;
+        size_t n = std::min<uint64_t>(std::min<uint64_t>(max, written - read), per_segment - off);
+        for (size_t b = (off + block - 1) / block * block; b < off + n; b += block) {
+            // start reading the block after each one we begin back in
+            size_t next = std::min(b + block, per_segment);
+            advise(s.base, next * sizeof(T), std::min(next + block, per_segment) * sizeof(T), MADV_WILLNEED);
+        }
+        memcpy(dst, s.base + off * sizeof(T), n * sizeof(T));
+        read += n;
+        if (read % per_segment == 0) {
+            release_head();
+        } else if ((read % per_segment) * sizeof(T) >= released + block * sizeof(T)) {
+            size_t end = ((read % per_segment) * sizeof(T)) & ~(page() - 1);
+            advise(s.base, released, end, MADV_REMOVE);
+            released = std::max(released, end);
+        }
+        return n;
+    }
+
+    void open_segment() {
+        Segment s;
+        s.bytes = per_segment * sizeof(T);
+        s.path = path + "." + std::to_string(first + segments.size());
+        int fd = open(s.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), s.path);
+        }
+        if (ftruncate(fd, s.bytes) != 0) {
+            int e = errno;
+            close(fd);
+            ::unlink(s.path.c_str());
+            throw std::system_error(e, std::generic_category(), "ftruncate");
+        }
+        void* p = mmap(nullptr, s.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int e = errno;
+        close(fd);
+        if (p == MAP_FAILED) {
+            ::unlink(s.path.c_str());
+            throw std::system_error(e, std::generic_category(), "mmap");
+        }
+        s.base = static_cast<unsigned char*>(p);
+        madvise(s.base, s.bytes, MADV_SEQUENTIAL);
+        segments.push_back(std::move(s));
+    }
+
+    /* drops the oldest segment, replayed or at destruction */
+    void release_head() {
+        Segment& s = segments.front();
+        munmap(s.base, s.bytes);
+        ::unlink(s.path.c_str());
+        segments.pop_front();
+        first++;
+        released = 0;
+    }
+
+    Queue q;
+    const std::string path;
+    const size_t block;
+    const size_t per_segment;  // entries per segment file
+
+    alignas(CACHELINE_SIZE) std::atomic<bool> spilling{false};
+    alignas(CACHELINE_SIZE) std::atomic<size_t> size{0};
+
+    std::mutex mutex;  // everything below
+    /* the block being filled, [stage_head, staged) not replayed yet, all
+     * of it newer than the segments */
+    std::unique_ptr<unsigned char[]> stage;
+    size_t stage_head = 0;
+    size_t staged = 0;
+    /* spill sequence numbers: [read, written) are in the segments */
+    uint64_t read = 0;
+    uint64_t written = 0;
+    std::deque<Segment> segments;  // segments[0] holds numbers from first * per_segment
+    uint64_t first = 0;
+    size_t released = 0;  // bytes of segments[0] punched out so far
+};
+
+}
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <initializer_list>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "harness.h"
+
+namespace PEX {
+namespace BBQ {
+namespace bench {
+
+/* just enough JSON to read back what print() writes with --format=json */
+struct Json {
+    enum Kind { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+    Kind kind = NUL;
+    double number = 0;
+    std::string string;
+    std::vector<Json> array;
+    std::vector<std::pair<std::string, Json>> object;
+
+    /* member key of an object, nullptr if there is none */
+    const Json* get(const std::string& key) const {
+        for (const auto& m : object) {
+            if (m.first == key) {
+                return &m.second;
+            }
+        }
+        return nullptr;
+    }
+
+    /* the number at a path of member keys, NaN if it is missing or null */
+    double at(std::initializer_list<const char*> path) const {
+        const Json* j = this;
+        for (const char* key : path) {
+            if (!(j = j->get(key))) {
+                return std::numeric_limits<double>::quiet_NaN();
+            }
+        }
+        return j->kind == NUMBER ? j->number : std::numeric_limits<double>::quiet_NaN();
+    }
+
+    static Json parse(const std::string& text) {
+        size_t i = 0;
+        Json j = value(text, i);
+        skip(text, i);
+        if (i != text.size()) {
+            throw std::runtime_error("trailing characters in JSON");
+        }
+        return j;
+    }
+
+private:
+    static void skip(const std::string& s, size_t& i) {
+        while (i < s.size() && isspace((unsigned char)s[i])) {
+            i++;
+        }
+    }
+
+    static void expect(const std::string& s, size_t& i, char c) {
+        skip(s, i);
+        if (i >= s.size() || s[i] != c) {
+            throw std::runtime_error(std::string("expected '") + c + "' in JSON");
+        }
+        i++;
+    }
+
+    static std::string str(const std::string& s, size_t& i) {
+        expect(s, i, '"');
+        std::string r;
+        while (i < s.size() && s[i] != '"') {
+            if (s[i] == '\\' && i + 1 < s.size()) {
+                i++;
+            }
+            r += s[i++];
+        }
+        expect(s, i, '"');
+        return r;
+    }
+
+    static Json value(const std::string& s, size_t& i) {
+        skip(s, i);
+        Json j;
+        if (i >= s.size()) {
+            throw std::runtime_error("unexpected end of JSON");
+        }
+        if (s[i] == '{') {
+            j.kind = OBJECT;
+            i++;
+            skip(s, i);
+            while (i < s.size() && s[i] != '}') {
+                std::string key = str(s, i);
+                expect(s, i, ':');
+                j.object.emplace_back(key, value(s, i));
+                skip(s, i);
+                if (i < s.size() && s[i] == ',') {
+                    i++;
+                    skip(s, i);
+                }
+            }
+            expect(s, i, '}');
+        } else if (s[i] == '[') {
+            j.kind = ARRAY;
+            i++;
+            skip(s, i);
+            while (i < s.size() && s[i] != ']') {
+                j.array.push_back(value(s, i));
+                skip(s, i);
+                if (i < s.size() && s[i] == ',') {
+                    i++;
+                }
+                skip(s, i);
+            }
+            expect(s, i, ']');
+        } else if (s[i] == '"') {
+            j.kind = STRING;
+            j.string = str(s, i);
+        } else if (s.compare(i, 4, "null") == 0) {
+            i += 4;
+        } else if (s.compare(i, 4, "true") == 0 || s.compare(i, 5, "false") == 0) {
+            j.kind = BOOL;
+            j.number = s[i] == 't';
+            i += s[i] == 't' ? 4 : 5;
+        } else {
+            char* end;
+            j.kind = NUMBER;
+            j.number = strtod(s.c_str() + i, &end);
+            if (end == s.c_str() + i) {
+                throw std::runtime_error("bad value in JSON");
+            }
+            i = end - s.c_str();
+        }
+        return j;
+    }
+};
+
+/* what a regression check compares: throughput, and per operation event
+ * counts where both sides have them */
+struct Sample {
+    double mops = 0;
+    PerfCounts prod = PerfCounts::unavailable();
+    PerfCounts cons = PerfCounts::unavailable();
+};
+
+/* the workload a result belongs to, runs of one workload are compared */
+inline std::string workload(const std::string& queue, double p, double c, double n, double b, double size) {
+    std::ostringstream o;
+    o << queue << " P=" << p << " C=" << c << " N=" << n << " B=" << b << " " << size << "B";
+    return o.str();
+}
+
+/* the median throughput run of every workload in a --format=json file */
+inline std::map<std::string, Sample> load_baseline(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("can not read baseline " + path);
+    }
+    std::stringstream text;
+    text << in.rdbuf();
+    Json all = Json::parse(text.str());
+    std::map<std::string, std::vector<Sample>> runs;
+    for (const Json& r : all.array) {
+        const Json* q = r.get("queue");
+        if (!q || q->kind != Json::STRING) {
+            continue;
+        }
+        std::string key = workload(q->string, r.at({"producers"}), r.at({"consumers"}), r.at({"capacity"}),
+                                   r.at({"blocks"}), r.at({"payload"}));
+        Sample s;
+        s.mops = r.at({"mops"});
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            s.prod.value[e] = r.at({"perf", "producers", perf_name(PerfEvent(e))});
+            s.cons.value[e] = r.at({"perf", "consumers", perf_name(PerfEvent(e))});
+        }
+        runs[key].push_back(s);
+    }
+    std::map<std::string, Sample> median;
+    for (auto& w : runs) {
+        std::vector<Sample>& v = w.second;
+        std::sort(v.begin(), v.end(), [](const Sample& a, const Sample& b) { return a.mops < b.mops; });
+        median[w.first] = v[v.size() / 2];
+    }
+    return median;
+}
+
+/* Compares the median run of every workload in rs against the baseline and
+ * reports each metric to out. Throughput regresses when it drops by more
+ * than tolerance (a fraction), an event count per operation when it grows
+ * by more than tolerance and by at least 0.05, so near-zero counts such as
+ * HITMs do not fail on noise. Returns false if anything regressed. */
+inline bool compare(FILE* out, const std::map<std::string, Sample>& baseline,
+                    const std::vector<std::vector<Result>>& rs, double tolerance) {
+    bool ok = true;
+    auto line = [&](const char* what, double base, double now, bool worse) {
+        fprintf(out, "  %-28s %12.3f -> %12.3f (%+6.1f%%)%s\n", what, base, now,
+                base ? (now / base - 1) * 100 : 0.0, worse ? "  REGRESSED" : "");
+        ok = ok && !worse;
+    };
+    for (const std::vector<Result>& runs : rs) {
+        Result r = median(runs);
+        const Config& c = r.config;
+        std::string key = workload(r.queue, c.producers, c.consumers, c.capacity, c.blocks, c.payload);
+        auto it = baseline.find(key);
+        fprintf(out, "%s\n", key.c_str());
+        if (it == baseline.end()) {
+            fprintf(out, "  no baseline\n");
+            continue;
+        }
+        const Sample& b = it->second;
+        line("Mops/s", b.mops, r.mops, r.mops < b.mops * (1 - tolerance));
+        const char* names[2] = {"producers", "consumers"};
+        const PerfCounts* base[2] = {&b.prod, &b.cons};
+        const PerfCounts* now[2] = {&r.prod, &r.cons};
+        for (int s = 0; s < 2; s++) {
+            for (int e = 0; e < PERF_EVENTS; e++) {
+                double x = base[s]->value[e], y = now[s]->value[e];
+                if (std::isnan(x) || std::isnan(y)) {
+                    continue;
+                }
+                std::string what = std::string(names[s]) + " " + perf_name(PerfEvent(e)) + "/op";
+                line(what.c_str(), x, y, y > x * (1 + tolerance) && y - x >= 0.05);
+            }
+        }
+    }
+    return ok;
+}
+
+}
+}
+}
@@ -0,0 +1,147 @@
+// Throughput and latency of the BBQ MPMC queue against baseline queues.
+//
+//   make bench && ./bench/bench --producers=4 --consumers=4 --pin=spread --format=csv
+//
+// Options, all --name=value:
+//   --queue      comma separated list of bbq, bbq-sep (the Separated layout),
+//                bbq-pf (Prefetch<>), bbq-exp (ExponentialBackoff<>), ring,
+//                mutex (default all six)
+//   --producers  producer threads (1)
+//   --consumers  consumer threads (1)
+//   --capacity   entries in the queue (4096)
+//   --blocks     blocks of the BBQ queue (16)
+//   --payload    entry size in bytes: 8, 16, 32, 64, 128 or 256 (8)
+//   --ops        entries enqueued by each producer (1000000)
+//   --warmup     runs thrown away first (1)
+//   --runs       runs measured (3)
+//   --sample     time one operation out of this many (64)
+//   --burst      producers pause after this many entries, 0 for never (0)
+//   --idle       length of a pause in cpu_relax() calls (0)
+//   --pin        none, same-core, smt, spread, cross-socket or a cpu list (none)
+//   --format     text, csv or json (text)
+//   --output     file to write the results to (stdout)
+//   --perf       1 to count cycles, instructions, L1D / LLC misses, branch
+//                misses and remote HITMs per operation, producers and
+//                consumers apart, with perf_event_open (0)
+//   --hitm-event raw perf config of the remote HITM event, 0 for none (the
+//                Intel MEM_LOAD_L3_MISS_RETIRED.REMOTE_HITM on Intel cpus)
+//   --baseline   a --format=json file of an earlier run: compare the median
+//                run of each workload with it, report to stderr and exit 1
+//                if throughput dropped or an event count per op grew
+//   --tolerance  percent change --baseline lets through (5)
+//
+// A regression check, counters on so a failure says where the time went:
+//
+//   ./bench/bench --queue=bbq --perf=1 --format=json --output=base.json
+//   ./bench/bench --queue=bbq --perf=1 --baseline=base.json
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "baseline.h"
+#include "harness.h"
+#include "queues.h"
+
+using namespace PEX::BBQ::bench;
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [--queue=bbq,bbq-sep,bbq-pf,bbq-exp,ring,mutex]\n"
+                    "       [--producers=P] [--consumers=C] [--capacity=N] [--blocks=B]\n"
+                    "       [--payload=BYTES] [--ops=OPS]\n"
+                    "       [--warmup=W] [--runs=R] [--sample=S] [--burst=N] [--idle=SPINS]\n"
+                    "       [--pin=none|same-core|smt|spread|cross-socket|CPU,CPU,...]\n"
+                    "       [--format=text|csv|json] [--output=FILE]\n"
+                    "       [--perf=0|1] [--hitm-event=RAW] [--baseline=FILE] [--tolerance=PCT]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    Config c;
+    std::string queues = "bbq,bbq-sep,bbq-pf,bbq-exp,ring,mutex";
+    std::string pin = "none";
+    std::string format = "text";
+    std::string output;
+    std::string baseline;
+    double tolerance = 5;
+
+    for (int i = 1; i < argc; i++) {
+        const char* eq = strchr(argv[i], '=');
+        if (strncmp(argv[i], "--", 2) != 0 || !eq) {
+            usage(argv[0]);
+        }
+        std::string key(argv[i] + 2, eq - argv[i] - 2);
+        const char* v = eq + 1;
+        if (key == "queue") queues = v;
+        else if (key == "pin") pin = v;
+        else if (key == "format") format = v;
+        else if (key == "output") output = v;
+        else if (key == "baseline") baseline = v;
+        else if (key == "tolerance") tolerance = strtod(v, nullptr);
+        else if (!parse_option(c, key, v)) usage(argv[0]);
+    }
+    if (!valid(c) || (format != "text" && format != "csv" && format != "json") || !(tolerance >= 0)) {
+        usage(argv[0]);
+    }
+
+    FILE* out = stdout;
+    if (!output.empty() && !(out = fopen(output.c_str(), "w"))) {
+        perror(output.c_str());
+        return 1;
+    }
+
+    bool ok = true;
+    try {
+        std::map<std::string, Sample> base;
+        if (!baseline.empty()) {
+            base = load_baseline(baseline);
+        }
+        std::vector<std::vector<Result>> all;
+        c.cpus = placement(pin, c.producers + c.consumers);
+        bool first = true;
+        print_header(out, format, c.perf);
+        with_payload(c.payload, [&](auto payload) {
+            using P = decltype(payload);
+            for (size_t i = 0; i < queues.size();) {
+                size_t j = std::min(queues.find(',', i), queues.size());
+                std::string name = queues.substr(i, j - i);
+                i = j + 1;
+                std::vector<Result> rs;
+                if (name == "bbq") {
+                    rs = run<BbqQueue<P>>("bbq", c);
+                } else if (name == "bbq-sep") {
+                    rs = run<BbqQueue<P, PEX::BBQ::Separated>>("bbq-sep", c);
+                } else if (name == "bbq-pf") {
+                    rs = run<BbqQueue<P, PEX::BBQ::Prefetch<>>>("bbq-pf", c);
+                } else if (name == "bbq-exp") {
+                    rs = run<BbqQueue<P, PEX::BBQ::ExponentialBackoff<>>>("bbq-exp", c);
+                } else if (name == "ring") {
+                    rs = run<RingBuffer<P>>("ring", c);
+                } else if (name == "mutex") {
+                    rs = run<MutexDeque<P>>("mutex", c);
+                } else {
+                    throw std::invalid_argument("unknown queue " + name);
+                }
+                for (const Result& r : rs) {
+                    print(out, format, r, first);
+                    first = false;
+                }
+                fflush(out);
+                all.push_back(rs);
+            }
+        });
+        print_footer(out, format);
+        if (!baseline.empty()) {
+            ok = compare(stderr, base, all, tolerance / 100);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "bench: %s\n", e.what());
+        return 1;
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+// Cost of the entry copies of enqueue_bulk / dequeue_bulk for each copy
+// kernel, on one thread so that only the copies and the per-block counter
+// updates are measured.
+//
+//   make copy && ./bench/copy --payload=8,16,64 --run=1,8,64,256
+//
+// Options, all --name=value:
+//   --isa        comma separated list of scalar, avx2, avx512, the stores of
+//                runs into blocks larger than --llc, those the cpu lacks
+//                are skipped; every other copy is the same for all (all three)
+//   --payload    comma separated entry sizes: 8, 16, 32, 64, 128 or 256 (8,16,64)
+//   --run        comma separated entries per bulk call (1,4,16,64,256)
+//   --capacity   entries in the queue (65536)
+//   --blocks     blocks of the queue (16)
+//   --entries    entries through the queue per run (20000000)
+//   --runs       runs measured, the median is reported (3)
+//   --backlog    1 to fill the whole queue a run at a time before draining
+//                it, so consumers trail producers by the capacity (0)
+//   --llc        bytes above which a block counts as larger than the last
+//                level cache and is written with non-temporal stores
+//                (the cache size of this machine)
+//
+// Each round enqueues a run from one array and dequeues it into another,
+// or with --backlog fills and drains the queue, so both directions are in
+// the ns/entry figure. The streaming path needs blocks larger than --llc,
+// for example --capacity=4194304 --blocks=4 --payload=64 --llc=33554432
+// --backlog=1, where the stores only pay off if the backlog is big.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../bbq.h"
+#include "harness.h"
+
+using namespace PEX::BBQ;
+using bench::with_payload;
+
+struct Options {
+    size_t capacity = 65536;
+    size_t blocks = 16;
+    uint64_t entries = 20000000;
+    unsigned runs = 3;
+    bool backlog = false;
+};
+
+static std::vector<std::string> split(const std::string& s) {
+    std::vector<std::string> v;
+    for (size_t i = 0; i < s.size();) {
+        size_t j = std::min(s.find(',', i), s.size());
+        v.push_back(s.substr(i, j - i));
+        i = j + 1;
+    }
+    return v;
+}
+
+/* median seconds per entry of run-sized round trips through q */
+template<class P>
+static double measure(const Options& o, size_t run) {
+    MPMC::DynamicQueue<P> q(o.capacity, o.blocks);
+    std::vector<P> src(run), dst(run);
+    std::vector<double> secs;
+    uint64_t rounds = std::max<uint64_t>(1, o.entries / run);
+    for (unsigned r = 0; r < o.runs; r++) {
+        uint64_t seq = 0, sum = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < rounds;) {
+            // rounds enqueued before the first dequeue, retry-new producers
+            // do not enter the block consumers are in, so a block less
+            uint64_t room = (o.capacity - o.capacity / o.blocks) / run;
+            uint64_t depth = o.backlog ? std::max<uint64_t>(1, std::min(rounds - i, room)) : 1;
+            for (uint64_t k = 0; k < depth; k++) {
+                for (P& p : src) {
+                    p.seq = seq++;
+                }
+                if (q.enqueue_bulk(src.data(), run) != run) {
+                    throw std::runtime_error("the queue is smaller than a run");
+                }
+            }
+            for (uint64_t k = 0; k < depth; k++) {
+                if (q.dequeue_bulk(dst.data(), run) != run) {
+                    throw std::runtime_error("entries went missing");
+                }
+                sum += dst[run - 1].seq;
+            }
+            i += depth;
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        // the last entry of round i is i * run + run - 1
+        if (sum != rounds * (rounds - 1) / 2 * run + rounds * (run - 1)) {
+            throw std::runtime_error("entries came out wrong");
+        }
+        secs.push_back(std::chrono::duration<double>(t1 - t0).count() / (rounds * run));
+    }
+    std::sort(secs.begin(), secs.end());
+    return secs[secs.size() / 2];
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [--isa=scalar,avx2,avx512] [--payload=BYTES,...] [--run=N,...]\n"
+                    "       [--capacity=N] [--blocks=B] [--entries=N] [--runs=R] [--backlog=0|1]\n"
+                    "       [--llc=BYTES]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    std::string isas = "scalar,avx2,avx512";
+    std::string payloads = "8,16,64";
+    std::string runs = "1,4,16,64,256";
+    for (int i = 1; i < argc; i++) {
+        const char* eq = strchr(argv[i], '=');
+        if (strncmp(argv[i], "--", 2) != 0 || !eq) {
+            usage(argv[0]);
+        }
+        std::string key(argv[i] + 2, eq - argv[i] - 2);
+        const char* v = eq + 1;
+        unsigned long n = strtoul(v, nullptr, 0);
+        if (key == "isa") isas = v;
+        else if (key == "payload") payloads = v;
+        else if (key == "run") runs = v;
+        else if (key == "capacity" && n) o.capacity = n;
+        else if (key == "blocks" && n) o.blocks = n;
+        else if (key == "entries" && n) o.entries = n;
+        else if (key == "runs" && n) o.runs = n;
+        else if (key == "backlog") o.backlog = n;
+        else if (key == "llc" && n) llc_bytes = n;
+        else usage(argv[0]);
+    }
+
+    const CopyIsa best = copy_isa;
+    try {
+        printf("%-8s %7s %5s %10s %10s\n", "isa", "payload", "run", "ns/entry", "GB/s");
+        for (const std::string& payload : split(payloads)) {
+            with_payload(strtoul(payload.c_str(), nullptr, 0), [&](auto p) {
+                using P = decltype(p);
+                for (const std::string& run : split(runs)) {
+                    size_t r = strtoul(run.c_str(), nullptr, 0);
+                    if (r == 0) {
+                        throw std::invalid_argument("runs are at least one entry");
+                    }
+                    for (const std::string& name : split(isas)) {
+                        CopyIsa isa = name == "scalar" ? COPY_SCALAR
+                                    : name == "avx2"   ? COPY_AVX2
+                                    : name == "avx512" ? COPY_AVX512
+                                    : throw std::invalid_argument("unknown isa " + name);
+                        if (isa > best) {
+                            continue;
+                        }
+                        copy_isa = isa;
+                        double s = measure<P>(o, r);
+                        // each entry is written into the block and out of it
+                        printf("%-8s %7zu %5zu %10.2f %10.2f\n", name.c_str(), sizeof(P), r, s * 1e9,
+                               2 * sizeof(P) / s / 1e9);
+                        fflush(stdout);
+                    }
+                }
+            });
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "copy: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
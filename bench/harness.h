@@ -0,0 +1,486 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "../bbq.h"
+#include "perf.h"
+
+namespace PEX {
+namespace BBQ {
+namespace bench {
+
+/* one workload: producers push ops entries each, consumers split them */
+struct Config {
+    unsigned producers = 1;
+    unsigned consumers = 1;
+    size_t capacity = 4096;
+    size_t blocks = 16;
+    size_t payload = 8;         // bytes per entry
+    uint64_t ops = 1000000;     // per producer
+    unsigned warmup = 1;        // runs thrown away before measuring
+    unsigned runs = 3;
+    unsigned sample = 64;       // time one op out of sample
+    unsigned burst = 0;         // producers pause after every burst entries, 0: never
+    unsigned idle = 0;          // cpu_relax() calls a pause lasts
+    std::vector<int> cpus;      // cpu of thread i is cpus[i % size], empty: unpinned
+    bool perf = false;          // count hardware events per thread
+    uint64_t hitm_event = ~0UL; // raw config of REMOTE_HITM, ~0: the cpu's default
+};
+
+/* sets the Config field named key from v, false if there is none */
+inline bool parse_option(Config& c, const std::string& key, const char* v) {
+    if (key == "producers") c.producers = atoi(v);
+    else if (key == "consumers") c.consumers = atoi(v);
+    else if (key == "capacity") c.capacity = strtoul(v, nullptr, 0);
+    else if (key == "blocks") c.blocks = strtoul(v, nullptr, 0);
+    else if (key == "payload") c.payload = strtoul(v, nullptr, 0);
+    else if (key == "ops") c.ops = strtoull(v, nullptr, 0);
+    else if (key == "warmup") c.warmup = atoi(v);
+    else if (key == "runs") c.runs = atoi(v);
+    else if (key == "sample") c.sample = atoi(v);
+    else if (key == "burst") c.burst = atoi(v);
+    else if (key == "idle") c.idle = atoi(v);
+    else if (key == "perf") c.perf = atoi(v);
+    else if (key == "hitm-event") c.hitm_event = strtoull(v, nullptr, 0);
+    else return false;
+    return true;
+}
+
+/* false if c can not run */
+inline bool valid(const Config& c) {
+    return c.producers && c.consumers && c.runs && c.sample && c.ops;
+}
+
+/* latencies in nanoseconds */
+struct Percentiles {
+    double p50 = 0;
+    double p99 = 0;
+    double p999 = 0;
+};
+
+struct Result {
+    std::string queue;
+    Config config;
+    unsigned run = 0;
+    double seconds = 0;
+    double mops = 0;            // million entries through the queue per second
+    Percentiles enq;
+    Percentiles deq;
+    PerfCounts prod;            // per entry enqueued, summed over producers
+    PerfCounts cons;            // per entry dequeued, summed over consumers
+};
+
+/* entry of payload S bytes, the first 8 carry a sequence number */
+template<size_t S>
+struct Payload {
+    static_assert(S > sizeof(uint64_t), "payloads are at least 8 bytes");
+    uint64_t seq;
+    unsigned char pad[S - sizeof(uint64_t)];
+};
+template<>
+struct Payload<sizeof(uint64_t)> {
+    uint64_t seq;
+};
+
+/* calls f(Payload<S>()) for the S matching bytes, f picks its type from it */
+template<class F>
+void with_payload(size_t bytes, F&& f) {
+    switch (bytes) {
+    case 8: f(Payload<8>()); break;
+    case 16: f(Payload<16>()); break;
+    case 32: f(Payload<32>()); break;
+    case 64: f(Payload<64>()); break;
+    case 128: f(Payload<128>()); break;
+    case 256: f(Payload<256>()); break;
+    default: throw std::invalid_argument("payload must be 8, 16, 32, 64, 128 or 256 bytes");
+    }
+}
+
+inline void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        throw std::runtime_error("can not pin to cpu " + std::to_string(cpu));
+    }
+}
+
+inline int read_topology(int cpu, const char* what) {
+    std::ifstream in("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/" + what);
+    int v = -1;
+    in >> v;
+    return v;
+}
+
+/* cpus for threads placed as how:
+ *   same-core     every thread on the first cpu
+ *   smt           alternating between the SMT siblings of one core
+ *   spread        one physical core each, first socket first
+ *   cross-socket  alternating between sockets, a physical core each
+ * or a comma separated list of cpu numbers */
+inline std::vector<int> placement(const std::string& how, unsigned threads) {
+    std::vector<int> cpus;
+    if (how.empty() || how == "none") {
+        return cpus;
+    }
+    cpu_set_t set;
+    sched_getaffinity(0, sizeof(set), &set);
+    if (how.find_first_not_of("0123456789,") == std::string::npos) {
+        for (size_t i = 0; i < how.size();) {
+            size_t j = how.find(',', i);
+            int cpu = std::stoi(how.substr(i, j - i));
+            // checked here, a thread failing to pin could only terminate
+            if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &set)) {
+                throw std::invalid_argument("can not run on cpu " + std::to_string(cpu));
+            }
+            cpus.push_back(cpu);
+            i = j == std::string::npos ? how.size() : j + 1;
+        }
+        return cpus;
+    }
+
+    // online cpus in the current affinity mask, with their core and socket
+    struct Cpu { int cpu, core, socket; };
+    std::vector<Cpu> online;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &set)) {
+            online.push_back({c, read_topology(c, "core_id"), read_topology(c, "physical_package_id")});
+        }
+    }
+    if (online.empty()) {
+        throw std::runtime_error("no cpus to run on");
+    }
+    // the first cpu of every physical core
+    std::vector<Cpu> cores;
+    for (const Cpu& c : online) {
+        if (std::none_of(cores.begin(), cores.end(), [&](const Cpu& o) {
+                return o.core == c.core && o.socket == c.socket; })) {
+            cores.push_back(c);
+        }
+    }
+
+    if (how == "same-core") {
+        cpus.push_back(online[0].cpu);
+    } else if (how == "smt") {
+        for (const Cpu& c : online) {
+            if (c.core == online[0].core && c.socket == online[0].socket) {
+                cpus.push_back(c.cpu);
+            }
+        }
+        if (cpus.size() < 2) {
+            throw std::runtime_error("the first core has no SMT sibling");
+        }
+    } else if (how == "spread") {
+        std::stable_sort(cores.begin(), cores.end(), [](const Cpu& a, const Cpu& b) {
+            return a.socket < b.socket; });
+        for (size_t i = 0; i < cores.size() && cpus.size() < threads; i++) {
+            cpus.push_back(cores[i].cpu);
+        }
+    } else if (how == "cross-socket") {
+        std::vector<int> sockets;
+        for (const Cpu& c : cores) {
+            if (std::find(sockets.begin(), sockets.end(), c.socket) == sockets.end()) {
+                sockets.push_back(c.socket);
+            }
+        }
+        if (sockets.size() < 2) {
+            throw std::runtime_error("only one socket");
+        }
+        // round-robin over the sockets, taking each socket's cores in turn
+        std::vector<size_t> taken(sockets.size(), 0);
+        for (size_t t = 0; cpus.size() < threads; t++) {
+            int s = sockets[t % sockets.size()];
+            size_t seen = 0;
+            bool found = false;
+            for (const Cpu& c : cores) {
+                if (c.socket == s && seen++ == taken[t % sockets.size()]) {
+                    cpus.push_back(c.cpu);
+                    taken[t % sockets.size()]++;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                break;
+            }
+        }
+    } else {
+        throw std::invalid_argument("unknown placement " + how);
+    }
+    return cpus;
+}
+
+inline Percentiles percentiles(std::vector<uint32_t>& ns) {
+    Percentiles p;
+    if (ns.empty()) {
+        return p;
+    }
+    std::sort(ns.begin(), ns.end());
+    auto at = [&](double q) { return (double)ns[std::min(ns.size() - 1, (size_t)(q * ns.size()))]; };
+    p.p50 = at(0.50);
+    p.p99 = at(0.99);
+    p.p999 = at(0.999);
+    return p;
+}
+
+/* spins on a full or empty queue, yielding now and then so oversubscribed
+ * runs (more threads than cpus) still make progress */
+template<class F>
+inline void retry(F&& op) {
+    for (unsigned i = 1; !op(); i++) {
+        if (i % 64 == 0) {
+            std::this_thread::yield();
+        } else {
+            cpu_relax();
+        }
+    }
+}
+
+/* one run of c against a fresh Q(c), Q has value_type, push() and pop()
+ * returning false when full / empty. Throughput counts every entry once,
+ * from the moment all threads are released until the last one is done;
+ * latency is that of a push or pop call including its retries. */
+template<class Q>
+Result run_once(const char* name, const Config& c, unsigned run) {
+    using P = typename Q::value_type;
+    std::unique_ptr<Q> q(new Q(c));
+    unsigned threads = c.producers + c.consumers;
+    uint64_t total = c.ops * c.producers;
+
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::vector<uint32_t>> enq(c.producers), deq(c.consumers);
+    std::vector<uint64_t> sums(c.consumers, 0);
+    std::vector<PerfCounts> perf(threads);
+    uint64_t hitm = c.hitm_event == ~0UL ? default_hitm_event() : c.hitm_event;
+    std::vector<std::thread> pool;
+
+    auto start = [&](unsigned id) {
+        if (!c.cpus.empty()) {
+            pin(c.cpus[id % c.cpus.size()]);
+        }
+        ready.fetch_add(1);
+        while (!go.load(std::memory_order_acquire)) {
+            cpu_relax();
+        }
+    };
+    auto timed = [&](std::vector<uint32_t>& out, uint64_t i, auto&& op) {
+        if (i % c.sample != 0) {
+            retry(op);
+            return;
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        retry(op);
+        auto t1 = std::chrono::steady_clock::now();
+        out.push_back((uint32_t)std::min<int64_t>(UINT32_MAX,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count()));
+    };
+
+    for (unsigned p = 0; p < c.producers; p++) {
+        enq[p].reserve(c.ops / c.sample + 1);
+        pool.emplace_back([&, p] {
+            PerfGroup counters(c.perf, hitm);
+            start(p);
+            counters.start();
+            P e{};
+            for (uint64_t i = 0; i < c.ops; i++) {
+                e.seq = i;
+                timed(enq[p], i, [&] { return q->push(e); });
+                if (c.burst && (i + 1) % c.burst == 0) {
+                    for (unsigned k = 0; k < c.idle; k++) {
+                        cpu_relax();
+                    }
+                }
+            }
+            counters.stop();
+            perf[p] = counters.read();
+        });
+    }
+    for (unsigned k = 0; k < c.consumers; k++) {
+        // consumers take fixed shares, nothing is shared but the queue
+        uint64_t share = total / c.consumers + (k < total % c.consumers);
+        deq[k].reserve(share / c.sample + 1);
+        pool.emplace_back([&, k, share] {
+            PerfGroup counters(c.perf, hitm);
+            start(c.producers + k);
+            counters.start();
+            P e;
+            uint64_t sum = 0;
+            for (uint64_t i = 0; i < share; i++) {
+                timed(deq[k], i, [&] { return q->pop(e); });
+                sum += e.seq;
+            }
+            counters.stop();
+            perf[c.producers + k] = counters.read();
+            sums[k] = sum;
+        });
+    }
+
+    while (ready.load() != threads) {
+        std::this_thread::yield();
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (std::thread& t : pool) {
+        t.join();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+
+    uint64_t sum = 0;
+    for (uint64_t s : sums) {
+        sum += s;
+    }
+    if (sum != c.producers * (c.ops * (c.ops - 1) / 2)) {
+        throw std::runtime_error(std::string(name) + " lost or duplicated entries");
+    }
+
+    std::vector<uint32_t> all;
+    Result r;
+    r.queue = name;
+    r.config = c;
+    r.run = run;
+    r.seconds = std::chrono::duration<double>(t1 - t0).count();
+    r.mops = total / r.seconds / 1e6;
+    for (auto& v : enq) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    r.enq = percentiles(all);
+    all.clear();
+    for (auto& v : deq) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    r.deq = percentiles(all);
+    for (unsigned t = 0; t < threads; t++) {
+        (t < c.producers ? r.prod : r.cons) += perf[t];
+    }
+    r.prod = r.prod.per(total);
+    r.cons = r.cons.per(total);
+    return r;
+}
+
+/* c.warmup runs thrown away, then c.runs measured ones */
+template<class Q>
+std::vector<Result> run(const char* name, const Config& c) {
+    for (unsigned i = 0; i < c.warmup; i++) {
+        run_once<Q>(name, c, 0);
+    }
+    std::vector<Result> rs;
+    for (unsigned i = 0; i < c.runs; i++) {
+        rs.push_back(run_once<Q>(name, c, i + 1));
+    }
+    return rs;
+}
+
+/* the run with the median throughput */
+inline Result median(std::vector<Result> rs) {
+    std::sort(rs.begin(), rs.end(), [](const Result& a, const Result& b) { return a.mops < b.mops; });
+    return rs[rs.size() / 2];
+}
+
+/* v with the printf format fmt, or none when it was not counted */
+inline std::string perf_value(double v, const char* fmt, const char* none) {
+    if (std::isnan(v)) {
+        return none;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), fmt, v);
+    return buf;
+}
+
+inline void print_header(FILE* out, const std::string& format, bool perf = false) {
+    if (format == "csv") {
+        fprintf(out, "queue,producers,consumers,capacity,blocks,payload,ops,run,seconds,mops,"
+                     "enq_p50_ns,enq_p99_ns,enq_p999_ns,deq_p50_ns,deq_p99_ns,deq_p999_ns");
+        for (const char* side : {"prod", "cons"}) {
+            for (int e = 0; perf && e < PERF_EVENTS; e++) {
+                fprintf(out, ",%s_%s_per_op", side, perf_name(PerfEvent(e)));
+            }
+        }
+        fprintf(out, "\n");
+    } else if (format == "json") {
+        fprintf(out, "[");
+    } else {
+        fprintf(out, "%-8s %3s %3s %8s %6s %4s %4s %10s %9s %9s %9s %9s %9s %9s\n",
+                "queue", "P", "C", "N", "B", "size", "run", "Mops/s",
+                "enq p50", "p99", "p99.9", "deq p50", "p99", "p99.9");
+    }
+}
+
+inline void print(FILE* out, const std::string& format, const Result& r, bool first) {
+    const Config& c = r.config;
+    const PerfCounts* sides[2] = {&r.prod, &r.cons};
+    if (format == "csv") {
+        fprintf(out, "%s,%u,%u,%zu,%zu,%zu,%lu,%u,%.6f,%.3f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f",
+                r.queue.c_str(), c.producers, c.consumers, c.capacity, c.blocks, c.payload,
+                (unsigned long)c.ops, r.run, r.seconds, r.mops,
+                r.enq.p50, r.enq.p99, r.enq.p999, r.deq.p50, r.deq.p99, r.deq.p999);
+        for (const PerfCounts* p : sides) {
+            for (int e = 0; c.perf && e < PERF_EVENTS; e++) {
+                fprintf(out, ",%s", perf_value(p->value[e], "%.4f", "").c_str());
+            }
+        }
+        fprintf(out, "\n");
+    } else if (format == "json") {
+        fprintf(out, "%s\n  {\"queue\": \"%s\", \"producers\": %u, \"consumers\": %u, "
+                     "\"capacity\": %zu, \"blocks\": %zu, \"payload\": %zu, \"ops\": %lu, "
+                     "\"run\": %u, \"seconds\": %.6f, \"mops\": %.3f, "
+                     "\"enq_ns\": {\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f}, "
+                     "\"deq_ns\": {\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f}",
+                first ? "" : ",", r.queue.c_str(), c.producers, c.consumers, c.capacity,
+                c.blocks, c.payload, (unsigned long)c.ops, r.run, r.seconds, r.mops,
+                r.enq.p50, r.enq.p99, r.enq.p999, r.deq.p50, r.deq.p99, r.deq.p999);
+        if (c.perf) {
+            // per operation, null for events that could not be counted
+            const char* names[2] = {"producers", "consumers"};
+            fprintf(out, ", \"perf\": {");
+            for (int s = 0; s < 2; s++) {
+                fprintf(out, "%s\"%s\": {", s ? ", " : "", names[s]);
+                for (int e = 0; e < PERF_EVENTS; e++) {
+                    fprintf(out, "%s\"%s\": %s", e ? ", " : "", perf_name(PerfEvent(e)),
+                            perf_value(sides[s]->value[e], "%.4f", "null").c_str());
+                }
+                fprintf(out, "}");
+            }
+            fprintf(out, "}");
+        }
+        fprintf(out, "}");
+    } else {
+        fprintf(out, "%-8s %3u %3u %8zu %6zu %4zu %4u %10.3f %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f\n",
+                r.queue.c_str(), c.producers, c.consumers, c.capacity, c.blocks, c.payload,
+                r.run, r.mops, r.enq.p50, r.enq.p99, r.enq.p999, r.deq.p50, r.deq.p99, r.deq.p999);
+        const char* names[2] = {"producers", "consumers"};
+        for (int s = 0; c.perf && s < 2; s++) {
+            fprintf(out, "    %-9s per op:", names[s]);
+            for (int e = 0; e < PERF_EVENTS; e++) {
+                fprintf(out, " %s %s", perf_name(PerfEvent(e)),
+                        perf_value(sides[s]->value[e], "%.2f", "n/a").c_str());
+            }
+            fprintf(out, "\n");
+        }
+    }
+}
+
+inline void print_footer(FILE* out, const std::string& format) {
+    if (format == "json") {
+        fprintf(out, "\n]\n");
+    }
+}
+
+}
+}
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace PEX {
+namespace BBQ {
+namespace bench {
+
+/* hardware events counted per thread with --perf=1 */
+enum PerfEvent {
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,         // L1 data cache read misses
+    LLC_MISSES,         // last level cache misses
+    BRANCH_MISSES,
+    REMOTE_HITM,        // loads served from a modified line in another
+                        // socket's cache, a raw event (--hitm-event)
+    PERF_EVENTS
+};
+
+inline const char* perf_name(PerfEvent e) {
+    static const char* const names[PERF_EVENTS] = {
+        "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "remote_hitm",
+    };
+    return names[e];
+}
+
+/* event counts of a group of threads, or per operation once divided; NaN
+ * where the event could not be counted */
+struct PerfCounts {
+    double value[PERF_EVENTS];
+
+    PerfCounts() {
+        for (double& v : value) {
+            v = 0;
+        }
+    }
+
+    static PerfCounts unavailable() {
+        PerfCounts p;
+        for (double& v : p.value) {
+            v = std::numeric_limits<double>::quiet_NaN();
+        }
+        return p;
+    }
+
+    PerfCounts& operator+=(const PerfCounts& o) {
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            value[e] += o.value[e];
+        }
+        return *this;
+    }
+
+    PerfCounts per(uint64_t ops) const {
+        PerfCounts p;
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            p.value[e] = ops ? value[e] / ops : value[e];
+        }
+        return p;
+    }
+};
+
+/* MEM_LOAD_L3_MISS_RETIRED.REMOTE_HITM (event 0xd3, umask 0x04) on Intel
+ * server cores since Skylake, 0 (not counted) elsewhere */
+inline uint64_t default_hitm_event() {
+    std::ifstream in("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 9, "vendor_id") == 0) {
+            return line.find("GenuineIntel") != std::string::npos ? 0x04d3 : 0;
+        }
+    }
+    return 0;
+}
+
+/* The PERF_EVENTS counters of the calling thread, user space only. Each
+ * event is opened on its own, so one the cpu or the kernel does not allow
+ * leaves the others working, and is scaled by time enabled over time
+ * running when the kernel multiplexes. Open, start and stop all in the
+ * thread being measured. */
+class PerfGroup {
+public:
+    /* opens nothing if !enabled, hitm is the raw config of REMOTE_HITM */
+    PerfGroup(bool enabled, uint64_t hitm) {
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            fd[e] = enabled ? open(PerfEvent(e), hitm) : -1;
+        }
+    }
+    ~PerfGroup() {
+        for (int f : fd) {
+            if (f >= 0) {
+                close(f);
+            }
+        }
+    }
+    PerfGroup(const PerfGroup&) = delete;
+    PerfGroup& operator=(const PerfGroup&) = delete;
+
+    void start() {
+        for (int f : fd) {
+            if (f >= 0) {
+                ioctl(f, PERF_EVENT_IOC_RESET, 0);
+                ioctl(f, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void stop() {
+        for (int f : fd) {
+            if (f >= 0) {
+                ioctl(f, PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+    }
+
+    /* counts since start(), NaN for events that are not open */
+    PerfCounts read() const {
+        PerfCounts p = PerfCounts::unavailable();
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            uint64_t v[3];  // value, time enabled, time running
+            if (fd[e] >= 0 && ::read(fd[e], v, sizeof(v)) == sizeof(v)) {
+                p.value[e] = v[2] ? (double)v[0] * v[1] / v[2] : 0;
+            }
+        }
+        return p;
+    }
+
+private:
+    static int open(PerfEvent e, uint64_t hitm) {
+        perf_event_attr a;
+        memset(&a, 0, sizeof(a));
+        a.size = sizeof(a);
+        a.disabled = 1;
+        a.exclude_kernel = 1;
+        a.exclude_hv = 1;
+        a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (e) {
+        case CYCLES:
+            a.type = PERF_TYPE_HARDWARE;
+            a.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case INSTRUCTIONS:
+            a.type = PERF_TYPE_HARDWARE;
+            a.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case L1D_MISSES:
+            a.type = PERF_TYPE_HW_CACHE;
+            a.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case LLC_MISSES:
+            a.type = PERF_TYPE_HARDWARE;
+            a.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case BRANCH_MISSES:
+            a.type = PERF_TYPE_HARDWARE;
+            a.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case REMOTE_HITM:
+            if (hitm == 0) {
+                return -1;
+            }
+            a.type = PERF_TYPE_RAW;
+            a.config = hitm;
+            break;
+        default:
+            return -1;
+        }
+        return (int)syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+    }
+
+    int fd[PERF_EVENTS];
+};
+
+}
+}
+}
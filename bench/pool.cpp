@@ -0,0 +1,345 @@
+// Tiny-task throughput of WorkStealingPool against a Chase-Lev pool and
+// std::async.
+//
+//   make pool && ./bench/pool --workers=4 --tasks=1000000
+//
+// Options, all --name=value:
+//   --pool       comma separated list of bbq, chase-lev, async (all three)
+//   --workers    worker threads (hardware concurrency)
+//   --tasks      tasks per run, spawned by one worker (1000000)
+//   --work       cpu_relax() calls per task (10)
+//   --depth      tree workload: every task up to this depth spawns two
+//                more, 0 for a flat loop of --tasks spawns (0)
+//   --capacity   entries of each worker queue (4096)
+//   --blocks     blocks of the bbq worker queues (64)
+//   --runs       runs measured, the median is reported (3)
+//   --async-tasks  tasks of the std::async runs, one thread each (20000)
+//
+// The flat workload has one task push all the others onto its worker's
+// queue, so everything the other workers run, they steal. The tree one
+// spreads spawning over all workers the way fork-join code does.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "../bbq_pool.h"
+
+using namespace PEX::BBQ;
+
+struct Options {
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    size_t tasks = 1000000;
+    unsigned work = 10;
+    unsigned depth = 0;
+    size_t capacity = 4096;
+    size_t blocks = 64;
+    unsigned runs = 3;
+    size_t async_tasks = 20000;
+};
+
+/* the classic work-stealing deque (Chase and Lev, in the C11 formulation of
+ * Le et al.) over a fixed ring: the owner pushes and pops at the bottom,
+ * thieves take single tasks from the top with a CAS */
+class ChaseLevDeque {
+public:
+    explicit ChaseLevDeque(size_t capacity) : mask(round_up(capacity) - 1), ring(new Task[mask + 1]) {}
+
+    bool push(const Task& t) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t top_ = top.load(std::memory_order_acquire);
+        if (b - top_ > (int64_t)mask) {
+            return false;
+        }
+        ring[b & mask] = t;
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool pop(Task& t) {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top_ = top.load(std::memory_order_relaxed);
+        if (top_ > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        t = ring[b & mask];
+        if (top_ == b) {
+            // the last task, race the thieves for it
+            bool won = top.compare_exchange_strong(top_, top_ + 1, std::memory_order_seq_cst,
+                                                   std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    bool steal(Task& t) {
+        int64_t top_ = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (top_ >= b) {
+            return false;
+        }
+        t = ring[top_ & mask];
+        return top.compare_exchange_strong(top_, top_ + 1, std::memory_order_seq_cst,
+                                           std::memory_order_relaxed);
+    }
+
+private:
+    static size_t round_up(size_t n) {
+        size_t p = 1;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    const size_t mask;
+    std::unique_ptr<Task[]> ring;
+    alignas(CACHELINE_SIZE) std::atomic<int64_t> top{0};
+    alignas(CACHELINE_SIZE) std::atomic<int64_t> bottom{0};
+};
+
+/* the baseline pool: WorkStealingPool's structure, injection queue and
+ * sleeping included, with a Chase-Lev deque per worker and single-task
+ * steals */
+class ChaseLevPool {
+public:
+    ChaseLevPool(size_t workers, size_t capacity) : inject(capacity, 64) {
+        for (size_t i = 0; i < workers; i++) {
+            threads.emplace_back(new Worker(i, capacity));
+        }
+        for (size_t i = 0; i < workers; i++) {
+            threads[i]->thread = std::thread([this, i] { run(*threads[i]); });
+        }
+    }
+    ~ChaseLevPool() {
+        wait_idle();
+        stopping.store(true, std::memory_order_seq_cst);
+        work.notify();
+        for (auto& w : threads) {
+            w->thread.join();
+        }
+    }
+
+    template<class F>
+    void submit(F f) {
+        Task t(f);
+        pending.fetch_add(1, std::memory_order_relaxed);
+        Worker* w = self();
+        if (w && w->pool == this) {
+            if (!w->deque.push(t) && !inject.enqueue(t)) {
+                execute(t);
+                return;
+            }
+            // the deque's push is no seq_cst RMW, notify() needs one
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        } else {
+            inject.enqueue_wait(t);
+        }
+        work.notify();
+    }
+
+    void wait_idle() {
+        wait_until(idle, [&] { return pending.load(std::memory_order_acquire) == 0; }, nullptr,
+                   [](unsigned) { cpu_relax(); });
+    }
+
+private:
+    struct Worker {
+        Worker(size_t index, size_t capacity) : index(index), deque(capacity) {}
+        const size_t index;
+        ChaseLevDeque deque;
+        const ChaseLevPool* pool = nullptr;
+        std::thread thread;
+    };
+
+    static Worker*& self() {
+        static thread_local Worker* w = nullptr;
+        return w;
+    }
+
+    void run(Worker& w) {
+        w.pool = this;
+        self() = &w;
+        while (!stopping.load(std::memory_order_acquire)) {
+            wait_until(work, [&] { return find(w) || stopping.load(std::memory_order_acquire); }, nullptr,
+                       [](unsigned) { cpu_relax(); });
+        }
+    }
+
+    bool find(Worker& w) {
+        Task t;
+        if (w.deque.pop(t) || inject.dequeue(t)) {
+            execute(t);
+            return true;
+        }
+        for (size_t k = 1; k < threads.size(); k++) {
+            if (threads[(w.index + k) % threads.size()]->deque.steal(t)) {
+                execute(t);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(Task& t) {
+        t();
+        if (pending.fetch_sub(1, std::memory_order_seq_cst) == 1) {
+            idle.notify();
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> threads;
+    MPMC::DynamicQueue<Task> inject;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> pending{0};
+    alignas(CACHELINE_SIZE) std::atomic<bool> stopping{false};
+    alignas(CACHELINE_SIZE) EventCount work;
+    alignas(CACHELINE_SIZE) EventCount idle;
+};
+
+static std::atomic<uint64_t> ran{0};
+
+static void spin(unsigned work) {
+    for (unsigned i = 0; i < work; i++) {
+        cpu_relax();
+    }
+}
+
+/* every task up to depth spawns two more, 2^(depth+1) - 1 tasks */
+template<class Pool>
+static void tree(Pool* pool, unsigned depth, unsigned work) {
+    spin(work);
+    ran.fetch_add(1, std::memory_order_relaxed);
+    if (depth > 0) {
+        pool->submit([pool, depth, work] { tree(pool, depth - 1, work); });
+        pool->submit([pool, depth, work] { tree(pool, depth - 1, work); });
+    }
+}
+
+/* seconds for one run of the workload */
+template<class Pool>
+static double measure(Pool& pool, const Options& o, uint64_t& tasks) {
+    ran.store(0);
+    auto t0 = std::chrono::steady_clock::now();
+    if (o.depth) {
+        Pool* p = &pool;
+        unsigned depth = o.depth, work = o.work;
+        pool.submit([p, depth, work] { tree(p, depth, work); });
+    } else {
+        Pool* p = &pool;
+        size_t n = o.tasks;
+        unsigned work = o.work;
+        pool.submit([p, n, work] {
+            for (size_t i = 0; i < n; i++) {
+                p->submit([work] {
+                    spin(work);
+                    ran.fetch_add(1, std::memory_order_relaxed);
+                });
+            }
+        });
+    }
+    pool.wait_idle();
+    auto t1 = std::chrono::steady_clock::now();
+    tasks = ran.load();
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+/* one std::async thread per task, in waves of a few hundred */
+static double measure_async(const Options& o, uint64_t& tasks) {
+    ran.store(0);
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::future<void>> wave;
+    for (size_t i = 0; i < o.async_tasks; i++) {
+        wave.push_back(std::async(std::launch::async, [&o] {
+            spin(o.work);
+            ran.fetch_add(1, std::memory_order_relaxed);
+        }));
+        if (wave.size() == 256) {
+            wave.clear();
+        }
+    }
+    wave.clear();
+    auto t1 = std::chrono::steady_clock::now();
+    tasks = ran.load();
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+static void report(const char* name, const Options& o, std::vector<double> secs, uint64_t tasks) {
+    std::sort(secs.begin(), secs.end());
+    double s = secs[secs.size() / 2];
+    printf("%-10s %7zu %10lu %12.3f %10.1f\n", name, o.workers, (unsigned long)tasks, tasks / s / 1e6,
+           s * 1e9 / tasks);
+    fflush(stdout);
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [--pool=bbq,chase-lev,async] [--workers=W] [--tasks=N] [--work=SPINS]\n"
+                    "       [--depth=D] [--capacity=N] [--blocks=B] [--runs=R] [--async-tasks=N]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    std::string pools = "bbq,chase-lev,async";
+    for (int i = 1; i < argc; i++) {
+        const char* eq = strchr(argv[i], '=');
+        if (strncmp(argv[i], "--", 2) != 0 || !eq) {
+            usage(argv[0]);
+        }
+        std::string key(argv[i] + 2, eq - argv[i] - 2);
+        const char* v = eq + 1;
+        unsigned long n = strtoul(v, nullptr, 0);
+        if (key == "pool") pools = v;
+        else if (key == "workers" && n) o.workers = n;
+        else if (key == "tasks" && n) o.tasks = n;
+        else if (key == "work") o.work = n;
+        else if (key == "depth" && n < 31) o.depth = n;
+        else if (key == "capacity" && n) o.capacity = n;
+        else if (key == "blocks" && n) o.blocks = n;
+        else if (key == "runs" && n) o.runs = n;
+        else if (key == "async-tasks" && n) o.async_tasks = n;
+        else usage(argv[0]);
+    }
+
+    try {
+        printf("%-10s %7s %10s %12s %10s\n", "pool", "workers", "tasks", "Mtasks/s", "ns/task");
+        for (size_t i = 0; i < pools.size();) {
+            size_t j = std::min(pools.find(',', i), pools.size());
+            std::string name = pools.substr(i, j - i);
+            i = j + 1;
+            std::vector<double> secs;
+            uint64_t tasks = 0;
+            if (name == "bbq") {
+                WorkStealingPool pool(o.workers, o.capacity, o.blocks);
+                for (unsigned r = 0; r < o.runs; r++) {
+                    secs.push_back(measure(pool, o, tasks));
+                }
+            } else if (name == "chase-lev") {
+                ChaseLevPool pool(o.workers, o.capacity);
+                for (unsigned r = 0; r < o.runs; r++) {
+                    secs.push_back(measure(pool, o, tasks));
+                }
+            } else if (name == "async") {
+                for (unsigned r = 0; r < o.runs; r++) {
+                    secs.push_back(measure_async(o, tasks));
+                }
+            } else {
+                throw std::invalid_argument("unknown pool " + name);
+            }
+            report(name.c_str(), o, secs, tasks);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "pool: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
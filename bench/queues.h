@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include "../bbq.h"
+#include "harness.h"
+
+namespace PEX {
+namespace BBQ {
+namespace bench {
+
+/* MPMC::DynamicQueue with c.capacity entries in c.blocks blocks */
+template<class P, class... Options>
+class BbqQueue {
+public:
+    using value_type = P;
+    explicit BbqQueue(const Config& c) : q(c.capacity, c.blocks) {}
+    bool push(const P& p) { return q.enqueue(p); }
+    bool pop(P& p) { return q.dequeue(p); }
+
+private:
+    MPMC::DynamicQueue<P, Options...> q;
+};
+
+/* baseline: the classic bounded MPMC ring buffer, one sequence number per
+ * cell and a CAS on a shared head or tail per operation, capacity rounded
+ * up to a power of two */
+template<class P>
+class RingBuffer {
+public:
+    using value_type = P;
+    explicit RingBuffer(const Config& c) : mask(round_up(c.capacity) - 1), cells(new Cell[mask + 1]) {
+        for (size_t i = 0; i <= mask; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const P& p) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = p;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(P& p) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        p = cell->data;
+        cell->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        P data;
+    };
+
+    static size_t round_up(size_t n) {
+        size_t p = 1;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    const size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    alignas(CACHELINE_SIZE) std::atomic<size_t> tail{0};
+    alignas(CACHELINE_SIZE) std::atomic<size_t> head{0};
+};
+
+/* baseline: std::deque behind a std::mutex, bounded to c.capacity */
+template<class P>
+class MutexDeque {
+public:
+    using value_type = P;
+    explicit MutexDeque(const Config& c) : capacity(c.capacity) {}
+
+    bool push(const P& p) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.size() == capacity) {
+            return false;
+        }
+        items.push_back(p);
+        return true;
+    }
+
+    bool pop(P& p) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty()) {
+            return false;
+        }
+        p = items.front();
+        items.pop_front();
+        return true;
+    }
+
+private:
+    const size_t capacity;
+    std::mutex mutex;
+    std::deque<P> items;
+};
+
+}
+}
+}
@@ -0,0 +1,157 @@
+// Picks the block count B (and capacity N) of the BBQ MPMC queue for a
+// workload on this machine by benchmarking every candidate pair.
+//
+//   make tune
+//   ./bench/tune --producers=4 --consumers=2 --capacity=1024,4096 --header=bbq_tuned.h --name=ingest
+//
+// Options, all --name=value, the workload ones are those of bench/bench:
+//   --producers --consumers --payload --ops --warmup --runs --sample --burst --idle --pin
+//   --capacity   comma separated candidate capacities (4096)
+//   --blocks     comma separated candidate block counts, by default every
+//                power of two from 2 to 1024 that divides the capacity
+//   --objective  throughput, or p99 for the lowest worse of the enqueue and
+//                dequeue p99 latency (throughput)
+//   --header     write the best pair to this file as constexpr values
+//   --name       name of the struct in the header (recommended)
+//
+// Every candidate runs warmup + runs times, the median run is its score.
+// Blocks are measured through DynamicQueue, which has the same layout as
+// Queue<T, N, B> with N and B read from memory instead of folded in.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "harness.h"
+#include "queues.h"
+
+using namespace PEX::BBQ::bench;
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [--producers=P] [--consumers=C] [--payload=BYTES] [--ops=OPS]\n"
+                    "       [--warmup=W] [--runs=R] [--sample=S] [--burst=N] [--idle=SPINS]\n"
+                    "       [--pin=...] [--capacity=N,N,...] [--blocks=B,B,...]\n"
+                    "       [--objective=throughput|p99] [--header=FILE] [--name=IDENT]\n", argv0);
+    exit(2);
+}
+
+static std::vector<size_t> parse_list(const std::string& s) {
+    std::vector<size_t> v;
+    for (size_t i = 0; i < s.size();) {
+        size_t j = std::min(s.find(',', i), s.size());
+        v.push_back(strtoul(s.substr(i, j - i).c_str(), nullptr, 0));
+        i = j + 1;
+    }
+    return v;
+}
+
+/* higher is better */
+static double score(const Result& r, const std::string& objective) {
+    if (objective == "p99") {
+        return -std::max(r.enq.p99, r.deq.p99);
+    }
+    return r.mops;
+}
+
+static void write_header(const char* path, const std::string& name, const Config& w, const Result& best) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+    fprintf(f, "#pragma once\n\n"
+               "// Generated by bench/tune, do not edit.\n"
+               "// Workload: %u producers, %u consumers, %zu byte entries, burst %u, idle %u.\n"
+               "// Best of the candidates: %.3f Mops/s, enqueue p99 %.0f ns, dequeue p99 %.0f ns.\n\n"
+               "#include <cstddef>\n\n"
+               "namespace PEX {\nnamespace BBQ {\nnamespace tuned {\n\n"
+               "/* MPMC::Queue<T, %s::capacity, %s::blocks> */\n"
+               "struct %s {\n"
+               "    static constexpr size_t capacity = %zu;\n"
+               "    static constexpr size_t blocks = %zu;\n"
+               "};\n\n"
+               "}\n}\n}\n",
+            w.producers, w.consumers, w.payload, w.burst, w.idle,
+            best.mops, best.enq.p99, best.deq.p99,
+            name.c_str(), name.c_str(), name.c_str(), best.config.capacity, best.config.blocks);
+    fclose(f);
+}
+
+int main(int argc, char** argv) {
+    Config w;
+    w.ops = 200000;
+    std::string capacities = "4096";
+    std::string blocks;
+    std::string pin = "none";
+    std::string objective = "throughput";
+    std::string header;
+    std::string name = "recommended";
+
+    for (int i = 1; i < argc; i++) {
+        const char* eq = strchr(argv[i], '=');
+        if (strncmp(argv[i], "--", 2) != 0 || !eq) {
+            usage(argv[0]);
+        }
+        std::string key(argv[i] + 2, eq - argv[i] - 2);
+        const char* v = eq + 1;
+        if (key == "capacity") capacities = v;
+        else if (key == "blocks") blocks = v;
+        else if (key == "pin") pin = v;
+        else if (key == "objective") objective = v;
+        else if (key == "header") header = v;
+        else if (key == "name") name = v;
+        else if (!parse_option(w, key, v)) usage(argv[0]);
+    }
+    if (!valid(w) || (objective != "throughput" && objective != "p99")) {
+        usage(argv[0]);
+    }
+
+    try {
+        w.cpus = placement(pin, w.producers + w.consumers);
+        // every (N, B) with whole blocks of at least one entry
+        std::vector<Config> candidates;
+        for (size_t n : parse_list(capacities)) {
+            std::vector<size_t> bs = parse_list(blocks);
+            if (blocks.empty()) {
+                for (size_t b = 2; b <= 1024; b *= 2) {
+                    bs.push_back(b);
+                }
+            }
+            for (size_t b : bs) {
+                if (b >= 2 && b <= n && n % b == 0) {
+                    Config c = w;
+                    c.capacity = n;
+                    c.blocks = b;
+                    candidates.push_back(c);
+                }
+            }
+        }
+        if (candidates.empty()) {
+            throw std::invalid_argument("no candidate divides its capacity into blocks");
+        }
+
+        Result best;
+        bool found = false;
+        print_header(stdout, "text");
+        for (const Config& c : candidates) {
+            with_payload(c.payload, [&](auto payload) {
+                Result r = median(run<BbqQueue<decltype(payload)>>("bbq", c));
+                print(stdout, "text", r, false);
+                fflush(stdout);
+                if (!found || score(r, objective) > score(best, objective)) {
+                    best = r;
+                    found = true;
+                }
+            });
+        }
+        printf("best: capacity %zu, blocks %zu (%.3f Mops/s, p99 %.0f / %.0f ns)\n",
+               best.config.capacity, best.config.blocks, best.mops, best.enq.p99, best.deq.p99);
+        if (!header.empty()) {
+            write_header(header.c_str(), name, w, best);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "tune: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -1,18 +1,25 @@
-// Compiled with: g++ -O2 -std=c++11 main.cpp -I./
+// Compiled with: g++ -O2 -std=c++17 main.cpp -I./, or -std=c++20 for the
+// coroutine checks
+// A usage example, for throughput and latency numbers see bench/bench.cpp
 #include <cassert>
+#include <atomic>
 #include <pthread.h>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 #include "bbq.h"
+#include "bbq_pool.h"
+#include "bbq_set.h"
+#include "bbq_spill.h"
 #include <stdint.h>
-#include <chrono>
 #include <stdlib.h>
 #include <unistd.h>
 
-static constexpr uint64_t ITERS = 16;
 static constexpr uint64_t CAPACITY = 16;
 static constexpr uint64_t NUM_OF_BLOCKS = 4;
 
-PEX::BBQ::SPSC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS> q;
+PEX::BBQ::MPMC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS> q;
 
 void *writer(void *arg)
 {
@@ -42,9 +49,683 @@ void *reader(void *arg)
     return NULL;
 }
 
+// Drop-old: producers lap a half-read block 0 into its next round while the
+// consumer is still in it. The consumer must give up the rest of block 0's
+// old round (1, 2, 3) and go on with blocks 1..3, then block 0's new round.
+static void check_drop_old_lap()
+{
+    PEX::BBQ::MPMC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS, PEX::BBQ::DropOld> d;
+    uint64_t v = ~0UL;
+    d.enqueue(0);
+    d.enqueue(1);
+    bool first = d.dequeue(v);
+    assert(first && v == 0);
+    for (uint64_t i = 2; i < 18; i++) {
+        d.enqueue(i);
+    }
+    uint64_t next = 4;
+    while (d.dequeue(v)) {
+        assert(v == next);
+        next++;
+    }
+    assert(next == 18 && d.dropped() == 3);
+    (void)first;
+    std::cout << "DROP-OLD LAP OK" << std::endl;
+}
+
+// A Slot dropped without commit() still publishes its entry: a value
+// initialized T in a queue, padding that consumers skip in a RecordQueue.
+static void check_abandoned_slot()
+{
+    PEX::BBQ::MPMC::Queue<std::string, CAPACITY, NUM_OF_BLOCKS> s;
+    {
+        auto slot = s.try_reserve();
+        assert(slot);
+    }
+    {
+        auto slot = s.try_reserve();
+        new (slot.ptr()) std::string("kept");
+        slot.commit();
+    }
+    std::string v = "stale";
+    bool got = s.dequeue(v);
+    assert(got && v.empty());
+    got = s.dequeue(v);
+    assert(got && v == "kept");
+    assert(!s.dequeue(v));
+
+    PEX::BBQ::MPMC::RecordQueue<> r(256, 4);
+    {
+        auto slot = r.try_reserve(13);
+        assert(slot);
+    }
+    got = r.enqueue("ok", 2);
+    assert(got);
+    size_t size = 0;
+    got = r.dequeue([&](const void* data, size_t n) {
+        assert(memcmp(data, "ok", 2) == 0);
+        size = n;
+    });
+    assert(got && size == 2);
+    assert(!r.dequeue([](const void*, size_t) { assert(false); }));
+    (void)got;
+    std::cout << "ABANDONED SLOT OK" << std::endl;
+}
+
+// RecordQueue: records that do not fit close their block and carry on in
+// the next one, zero and max_size() bytes go through, and records of four
+// producers come out whole and in each producer's order.
+static void check_records()
+{
+    PEX::BBQ::MPMC::RecordQueue<> r(256, 4);
+    unsigned char buf[64], out[64];
+    size_t got = 0;
+    auto take = [&](const void* data, size_t n) {
+        memcpy(out, data, n);
+        got = n;
+    };
+    // 64 byte blocks: 40 bytes for a 30 byte record, so every second one
+    // straddles a block end, round after round
+    for (unsigned i = 0; i < 40; i++) {
+        size_t n = i % 2 ? 30 : 12;
+        memset(buf, 'a' + i % 26, n);
+        bool ok = r.enqueue(buf, n);
+        assert(ok);
+        ok = r.dequeue(take);
+        assert(ok && got == n && memcmp(out, buf, n) == 0);
+        (void)ok;
+    }
+    for (unsigned i = 0; i < 2; i++) {
+        bool ok = r.enqueue(buf, 0);
+        assert(ok);
+        memset(buf, 'z', r.max_size());
+        ok = r.enqueue(buf, r.max_size());
+        assert(ok);
+        ok = r.dequeue(take);
+        assert(ok && got == 0);
+        ok = r.dequeue(take);
+        assert(ok && got == r.max_size() && memcmp(out, buf, got) == 0);
+        (void)ok;
+    }
+    bool thrown = false;
+    try {
+        r.try_reserve(r.max_size() + 1);
+    } catch (const std::length_error&) {
+        thrown = true;
+    }
+    assert(thrown && !r.dequeue(take));
+    (void)thrown;
+
+    // each record is the producer, a sequence number and 0..39 bytes of a
+    // pattern from both
+    static constexpr unsigned PRODUCERS = 4, RECORDS = 20000;
+    PEX::BBQ::MPMC::RecordQueue<> m(4096, 8);
+    std::vector<std::thread> ts;
+    for (unsigned p = 0; p < PRODUCERS; p++) {
+        ts.emplace_back([&m, p] {
+            unsigned char rec[48];
+            for (uint32_t i = 0; i < RECORDS; i++) {
+                size_t n = 8 + i % 40;
+                memcpy(rec, &p, 4);
+                memcpy(rec + 4, &i, 4);
+                for (size_t k = 8; k < n; k++) {
+                    rec[k] = (unsigned char)(p * 31 + i + k);
+                }
+                while (!m.enqueue(rec, n)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    uint32_t next[PRODUCERS] = {};
+    for (unsigned left = PRODUCERS * RECORDS; left;) {
+        // a producer preempted between its claim and commit holds up the
+        // block, so give way rather than spin on one core
+        bool ok = m.dequeue([&](const void* data, size_t n) {
+            const unsigned char* rec = static_cast<const unsigned char*>(data);
+            uint32_t p, i;
+            memcpy(&p, rec, 4);
+            memcpy(&i, rec + 4, 4);
+            assert(p < PRODUCERS && i == next[p] && n == 8 + i % 40);
+            for (size_t k = 8; k < n; k++) {
+                assert(rec[k] == (unsigned char)(p * 31 + i + k));
+            }
+            next[p]++;
+            left--;
+        });
+        if (!ok) {
+            std::this_thread::yield();
+        }
+    }
+    for (std::thread& t : ts) {
+        t.join();
+    }
+    assert(!m.dequeue(take));
+    std::cout << "RECORDS OK" << std::endl;
+}
+
+// enqueue_bulk / dequeue_bulk: four producers push runs of 1 to 7 entries
+// into a 16 entry queue while two consumers take runs of up to 5, every
+// entry comes out exactly once.
+static void check_bulk()
+{
+    static constexpr uint64_t PRODUCERS = 4, CONSUMERS = 2, ENTRIES = 50000;
+    PEX::BBQ::MPMC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS> b;
+    std::vector<std::atomic<uint8_t>> seen(PRODUCERS * ENTRIES);
+    std::atomic<uint64_t> taken{0};
+    std::vector<std::thread> ts;
+    for (uint64_t p = 0; p < PRODUCERS; p++) {
+        ts.emplace_back([&b, p] {
+            uint64_t run[7];
+            for (uint64_t i = 0; i < ENTRIES;) {
+                size_t n = std::min<uint64_t>(1 + (i + p) % 7, ENTRIES - i);
+                for (size_t k = 0; k < n; k++) {
+                    run[k] = p * ENTRIES + i + k;
+                }
+                size_t done = b.enqueue_bulk(run, n);
+                i += done;
+                if (done < n) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (uint64_t c = 0; c < CONSUMERS; c++) {
+        ts.emplace_back([&] {
+            uint64_t run[5];
+            while (taken.load() < PRODUCERS * ENTRIES) {
+                size_t n = b.dequeue_bulk(run, 5);
+                for (size_t k = 0; k < n; k++) {
+                    assert(run[k] < PRODUCERS * ENTRIES);
+                    seen[run[k]]++;
+                }
+                taken += n;
+                if (n == 0) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread& t : ts) {
+        t.join();
+    }
+    for (std::atomic<uint8_t>& e : seen) {
+        assert(e == 1);
+        (void)e;
+    }
+    uint64_t v;
+    assert(taken == PRODUCERS * ENTRIES && !b.dequeue(v));
+    (void)v;
+    std::cout << "BULK OK" << std::endl;
+}
+
+// Broadcast: a drop-old subscriber lapped by the producer skips to an
+// intact block and counts what it missed in dropped(), a late subscriber
+// starts at the producer's block, and unsubscribing frees both the slot
+// and, in retry-new mode, the blocks the subscriber held up.
+static void check_broadcast()
+{
+    PEX::BBQ::Broadcast::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS, 2, PEX::BBQ::DropOld> d;
+    auto s1 = d.subscribe();
+    assert(s1);
+    for (uint64_t i = 0; i < 4; i++) {
+        d.enqueue(i);
+    }
+    uint64_t v = ~0UL, read = 0;
+    bool got = s1.dequeue(v);
+    assert(got && v == 0 && s1.dropped() == 0);
+    read++;
+    for (uint64_t i = 4; i < 40; i++) {
+        d.enqueue(i);
+    }
+    // the producer is in block 9, blocks 7 and 8 are the oldest intact
+    while (s1.dequeue(v)) {
+        assert(v == read + s1.dropped());
+        read++;
+    }
+    assert(s1.dropped() == 27 && read + s1.dropped() == 40);
+
+    auto s2 = d.subscribe();
+    assert(s2 && !d.subscribe());
+    for (uint64_t i = 40; i < 42; i++) {
+        d.enqueue(i);
+    }
+    for (uint64_t i = 36; i < 42; i++) {
+        got = s2.dequeue(v);
+        assert(got && v == i);
+    }
+    assert(!s2.dequeue(v) && s2.dropped() == 0);
+    s1 = decltype(s1)();
+    auto s3 = d.subscribe();
+    assert(s3);
+
+    PEX::BBQ::Broadcast::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS, 2> r;
+    auto slow = r.subscribe();
+    uint64_t n = 0;
+    while (r.enqueue(n)) {
+        n++;
+    }
+    assert(n == CAPACITY);
+    slow = decltype(slow)();
+    got = r.enqueue(n);
+    assert(got);
+    (void)got;
+    std::cout << "BROADCAST OK" << std::endl;
+}
+
+// reset() with entries of the old round left in memory: none of them may
+// come back, neither right away nor once the producers are back in the
+// blocks that still hold them.
+template<class Q>
+static void check_reset_on(Q& r)
+{
+    uint64_t v;
+    for (uint64_t i = 0; i < 40; i++) {
+        r.enqueue(1UL << 32 | i);
+    }
+    for (uint64_t i = 0; i < 3; i++) {
+        bool got = r.dequeue(v);
+        assert(got && v >> 32 == 1);
+        (void)got;
+    }
+    r.reset();
+    assert(!r.dequeue(v));
+    for (uint64_t n : {2, 9}) {
+        for (uint64_t i = 0; i < n; i++) {
+            bool ok = r.enqueue(2UL << 32 | i);
+            assert(ok);
+            (void)ok;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            bool got = r.dequeue(v);
+            assert(got && v == (2UL << 32 | i));
+            (void)got;
+        }
+        assert(!r.dequeue(v));
+    }
+    for (uint64_t i = 0; i < 5; i++) {
+        r.enqueue(3UL << 32 | i);
+    }
+    r.reset();
+    assert(!r.dequeue(v));
+    r.enqueue(4UL << 32);
+    bool got = r.dequeue(v);
+    assert(got && v == 4UL << 32 && !r.dequeue(v));
+    (void)got;
+}
+
+static void check_reset()
+{
+    PEX::BBQ::MPMC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS> r;
+    check_reset_on(r);
+    PEX::BBQ::MPMC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS, PEX::BBQ::DropOld> d;
+    check_reset_on(d);
+    assert(d.dropped() == 0);
+    PEX::BBQ::SPSC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS> s;
+    check_reset_on(s);
+    std::cout << "RESET OK" << std::endl;
+}
+
+// A Producer handle that goes with entries the full queue can not take
+// yet waits for a consumer to make room instead of losing them, and
+// discard() drops what is staged.
+static void check_producer_handle()
+{
+    PEX::BBQ::MPMC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS> w;
+    uint64_t n = 0, v;
+    while (w.enqueue(n)) {
+        n++;
+    }
+    std::atomic<bool> go{false};
+    uint64_t next = 0;
+    std::thread consumer([&] {
+        while (!go.load()) {
+            std::this_thread::yield();
+        }
+        while (next < n + 20) {
+            if (w.dequeue(v)) {
+                assert(v == next);
+                next++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+    {
+        auto p = w.producer(8, std::chrono::nanoseconds(0));
+        for (uint64_t i = n; i < n + 20; i++) {
+            if (!p.enqueue(i)) {
+                go = true;
+                while (!p.enqueue(i)) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+        go = true;
+    }
+    consumer.join();
+    assert(next == n + 20 && !w.dequeue(v));
+    {
+        auto p = w.producer(8, std::chrono::nanoseconds(0));
+        p.enqueue(1);
+        p.enqueue(2);
+        size_t dropped = p.discard();
+        assert(dropped == 2 && p.pending() == 0);
+        (void)dropped;
+    }
+    assert(!w.dequeue(v));
+    std::cout << "PRODUCER HANDLE OK" << std::endl;
+}
+
+// SPSC::QueueSet: producers pause every few entries so the consumer keeps
+// finding the set empty and going to sleep, a lost wake-up shows as a
+// dequeue_bulk_for that times out with entries still to come.
+static void check_queue_set()
+{
+    static constexpr uint64_t PRODUCERS = 3, ENTRIES = 3000;
+    PEX::BBQ::SPSC::QueueSet<uint64_t, CAPACITY, NUM_OF_BLOCKS> set(PRODUCERS);
+    std::vector<std::thread> ts;
+    for (uint64_t p = 0; p < PRODUCERS; p++) {
+        ts.emplace_back([&set, p] {
+            for (uint64_t i = 0; i < ENTRIES; i++) {
+                while (!set.enqueue(p, p << 32 | i)) {
+                    std::this_thread::yield();
+                }
+                if (i % 3 == p) {
+                    usleep(1);
+                }
+            }
+        });
+    }
+    uint64_t next[PRODUCERS] = {}, buf[8];
+    for (uint64_t left = PRODUCERS * ENTRIES; left;) {
+        size_t n = set.dequeue_bulk_for(buf, 8, std::chrono::seconds(2));
+        assert(n > 0);
+        for (size_t k = 0; k < n; k++) {
+            uint64_t p = buf[k] >> 32;
+            assert(p < PRODUCERS && (buf[k] & 0xffffffff) == next[p]);
+            next[p]++;
+        }
+        left -= n;
+    }
+    for (std::thread& t : ts) {
+        t.join();
+    }
+    assert(set.dequeue_bulk(buf, 8) == 0);
+    std::cout << "QUEUE SET OK" << std::endl;
+}
+
+// WorkStealingPool: one task spawns all the others onto its worker's own
+// queue and waits until another worker ran one of them, which that worker
+// can only have stolen; every task runs exactly once.
+struct PoolCheck {
+    static constexpr size_t TASKS = 2000;
+    PEX::BBQ::WorkStealingPool* pool;
+    std::thread::id spawner;
+    std::atomic<uint8_t> runs[TASKS];
+    std::atomic<uint64_t> stolen{0};
+};
+
+static void check_pool()
+{
+    PEX::BBQ::WorkStealingPool pool(2, 4096, 64);
+    static PoolCheck c;
+    c.pool = &pool;
+    pool.submit([] {
+        c.spawner = std::this_thread::get_id();
+        for (size_t i = 0; i < PoolCheck::TASKS; i++) {
+            c.pool->submit([i] {
+                c.runs[i]++;
+                if (std::this_thread::get_id() != c.spawner) {
+                    c.stolen++;
+                }
+            });
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (c.stolen.load() == 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+        }
+    });
+    pool.wait_idle();
+    for (std::atomic<uint8_t>& r : c.runs) {
+        assert(r == 1);
+        (void)r;
+    }
+    assert(c.stolen > 0);
+    std::cout << "POOL OK" << std::endl;
+}
+
+// Timed calls on an empty or full queue give up no earlier than their
+// deadline, not long after it, and the blocking ones wake up for the
+// thread that makes them go through.
+static void check_timed()
+{
+    using clock = std::chrono::steady_clock;
+    const auto d = std::chrono::milliseconds(20);
+    PEX::BBQ::MPMC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS> t;
+    uint64_t v;
+    auto t0 = clock::now();
+    bool ok = t.try_dequeue_for(v, d);
+    auto waited = clock::now() - t0;
+    assert(!ok && waited >= d && waited < d + std::chrono::seconds(1));
+    uint64_t n = 0;
+    while (t.enqueue(n)) {
+        n++;
+    }
+    t0 = clock::now();
+    ok = t.try_enqueue_for(n, d);
+    waited = clock::now() - t0;
+    assert(!ok && waited >= d && waited < d + std::chrono::seconds(1));
+
+    // the other side comes in halfway through, well before the deadline
+    std::thread consumer([&] {
+        usleep(10000);
+        uint64_t w;
+        for (uint64_t i = 0; i <= n; i++) {
+            t.dequeue_wait(w);
+            assert(w == i);
+        }
+    });
+    ok = t.try_enqueue_for(n, std::chrono::seconds(5));
+    assert(ok);
+    consumer.join();
+    std::thread producer([&] {
+        usleep(10000);
+        t.enqueue_wait(n + 1);
+    });
+    ok = t.try_dequeue_for(v, std::chrono::seconds(5));
+    assert(ok && v == n + 1);
+    producer.join();
+    (void)ok;
+    (void)waited;
+    std::cout << "TIMED OK" << std::endl;
+}
+
+// SPSC: a full queue takes nothing until a whole block is consumed, then
+// exactly a block, an empty one gives nothing, and entries stay in order
+// while the blocks wrap around round after round, on one thread and
+// between two.
+static void check_spsc()
+{
+    static constexpr uint64_t NE = CAPACITY / NUM_OF_BLOCKS;
+    PEX::BBQ::SPSC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS> s;
+    uint64_t in = 0, out = 0, v;
+    while (s.enqueue(in)) {
+        in++;
+    }
+    assert(in == CAPACITY);
+    for (uint64_t i = 0; i < NE; i++) {
+        assert(!s.enqueue(in));
+        bool got = s.dequeue(v);
+        assert(got && v == out);
+        out++;
+        (void)got;
+    }
+    for (uint64_t i = 0; i < NE; i++) {
+        bool ok = s.enqueue(in++);
+        assert(ok);
+        (void)ok;
+    }
+    assert(!s.enqueue(in));
+    while (s.dequeue(v)) {
+        assert(v == out);
+        out++;
+    }
+    assert(out == in && s.empty());
+
+    // an empty queue takes the rest of the consumer's block and the other
+    // blocks, so at least CAPACITY - NE + 1 entries
+    uint64_t buf[CAPACITY];
+    for (uint64_t round = 0; round < 100; round++) {
+        size_t k = 1 + round % (CAPACITY - NE + 1);
+        for (size_t i = 0; i < k; i++) {
+            buf[i] = in++;
+        }
+        size_t n = s.enqueue_bulk(buf, k);
+        assert(n == k);
+        n = s.dequeue_bulk(buf, CAPACITY);
+        assert(n == k && s.empty());
+        for (size_t i = 0; i < k; i++) {
+            assert(buf[i] == out);
+            out++;
+        }
+    }
+
+    static constexpr uint64_t ENTRIES = 100000;
+    std::thread producer([&s, in] {
+        for (uint64_t i = in; i < in + ENTRIES; i++) {
+            while (!s.enqueue(i)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    while (out < in + ENTRIES) {
+        if (s.dequeue(v)) {
+            assert(v == out);
+            out++;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    assert(s.empty());
+    std::cout << "SPSC OK" << std::endl;
+}
+
+// SpillQueue: two producers overflow a 16 entry queue into one block
+// segments, a drain afterwards sees each producer's entries in order and
+// leaves no spill and no segment file behind.
+static void check_spill()
+{
+    static constexpr uint64_t PRODUCERS = 2, ENTRIES = 200;
+    std::string path = "/tmp/bbq_main_spill." + std::to_string(getpid());
+    PEX::BBQ::SpillQueue<uint64_t> sq(CAPACITY, NUM_OF_BLOCKS, path, 1);
+    std::vector<std::thread> ts;
+    for (uint64_t p = 0; p < PRODUCERS; p++) {
+        ts.emplace_back([&sq, p] {
+            for (uint64_t i = 0; i < ENTRIES; i++) {
+                sq.enqueue(p << 32 | i);
+            }
+        });
+    }
+    for (std::thread& t : ts) {
+        t.join();
+    }
+    assert(sq.spilled() > 2 * CAPACITY / NUM_OF_BLOCKS);
+    assert(access((path + ".0").c_str(), F_OK) == 0 && access((path + ".1").c_str(), F_OK) == 0);
+    uint64_t next[PRODUCERS] = {}, v, n = 0;
+    while (sq.dequeue(v)) {
+        uint64_t p = v >> 32;
+        assert(p < PRODUCERS && (v & 0xffffffff) == next[p]);
+        next[p]++;
+        n++;
+    }
+    assert(n == PRODUCERS * ENTRIES && sq.spilled() == 0);
+    for (uint64_t k = 0; k * CAPACITY / NUM_OF_BLOCKS < n; k++) {
+        assert(access((path + "." + std::to_string(k)).c_str(), F_OK) != 0);
+    }
+    (void)n;
+    std::cout << "SPILL OK" << std::endl;
+}
+
+#if defined(__cpp_impl_coroutine)
+// Fire and forget coroutine, runs until its first suspension right away
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+template<class Q>
+static Detached await_dequeue(Q& a, uint64_t& v, bool& done)
+{
+    v = co_await a.async_dequeue();
+    done = true;
+}
+
+template<class Q>
+static Detached await_enqueue(Q& a, uint64_t v, bool& done)
+{
+    co_await a.async_enqueue(v);
+    done = true;
+}
+
+// async_dequeue on an empty queue and async_enqueue on a full one suspend,
+// and the enqueue / dequeue that lets them through resumes them inline.
+static void check_coroutines()
+{
+    PEX::BBQ::MPMC::Queue<uint64_t, CAPACITY, NUM_OF_BLOCKS> a;
+    uint64_t v = 0;
+    bool done = false;
+    await_dequeue(a, v, done);
+    assert(!done);
+    bool ok = a.enqueue(7);
+    assert(ok && done && v == 7);
+
+    uint64_t n = 0;
+    while (a.enqueue(n)) {
+        n++;
+    }
+    done = false;
+    await_enqueue(a, n, done);
+    assert(!done);
+    uint64_t next = 0;
+    while (!done) {
+        ok = a.dequeue(v);
+        assert(ok && v == next);
+        next++;
+    }
+    while (a.dequeue(v)) {
+        assert(v == next);
+        next++;
+    }
+    assert(next == n + 1);
+    (void)ok;
+    std::cout << "COROUTINES OK" << std::endl;
+}
+#endif
+
 int main(void)
 {
-    auto begin = std::chrono::steady_clock::now();
+    check_drop_old_lap();
+    check_abandoned_slot();
+    check_bulk();
+    check_records();
+    check_spill();
+    check_broadcast();
+    check_reset();
+    check_producer_handle();
+    check_queue_set();
+    check_pool();
+    check_timed();
+    check_spsc();
+#if defined(__cpp_impl_coroutine)
+    check_coroutines();
+#endif
 
     const uint64_t numThreads = 2;
     pthread_t t_writerid[numThreads];
@@ -75,11 +756,5 @@ int main(void)
 
     std::cout << "CONSUMERS DONE" << std::endl;
     q.printData();
-
-    auto end = std::chrono::steady_clock::now();
-
-    float time_in_sec = std::chrono::duration<double, std::milli>(end - begin).count() / 1000.0;
-    uint64_t total_op = ITERS * 2; // producer's and consumer's
-    std::cout << "SPSC BBQ: finish writing and reading with throughput = " << total_op / time_in_sec << " op/s.\n";
     return 0;
 }